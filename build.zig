@@ -25,7 +25,7 @@ pub fn build(b: *std.Build) void {
 
     const cflags = [_][]const u8{"-Wall"};
     _ = cflags;
-    const cfiles_src = [_][]const u8{ "main.c", "chunk.c", "memory.c", "debug.c", "value.c", "vm.c", "compiler.c", "scanner.c", "object.c", "table.c" };
+    const cfiles_src = [_][]const u8{ "main.c", "chunk.c", "memory.c", "debug.c", "value.c", "vm.c", "compiler.c", "scanner.c", "object.c", "table.c", "heap.c", "cache.c", "parallel.c", "module.c", "number.c" };
     exe.addIncludePath("./");
     exe.addCSourceFiles(&cfiles_src, &.{});
 
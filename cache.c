@@ -0,0 +1,708 @@
+#include "cache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 文件格式 (整数都是小端):
+//   header:   magic[8] | u32 version | u32 0 | u64 source hash
+//   selector: u32 count | count * (u32 length | chars)
+//   function: u32 arity | u32 upvalue count | name | u32 code count
+//             | code bytes | 对齐到 4 | u32 lines[count]
+//             | u32 constant count | constants
+//   constant: u8 tag | payload
+// 字节码里的 selector 编号只在写出它的 VM 里有效, 载入时按名字重新登记
+// 小端机器上 code 和 lines 不复制, 直接指向只读映射
+#define CACHE_NO_NAME UINT32_MAX
+#define CACHE_MAX_NESTING 256
+
+typedef enum {
+  CONST_NIL,
+  CONST_FALSE,
+  CONST_TRUE,
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+} CacheConstant;
+
+// FNV-1a, 和 VM 的随机哈希种子无关, 换个进程也一样
+uint64_t hashSource(const char *source, size_t length) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash == 0 ? 1 : hash; // 0 表示不检查
+}
+
+static void writeBytes(CacheWriter *writer, const void *bytes, size_t count) {
+  if (writer->count + count > writer->capacity) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+    while (capacity < writer->count + count) {
+      capacity *= 2;
+    }
+    writer->bytes = (uint8_t *)realloc(writer->bytes, capacity);
+    if (writer->bytes == NULL) {
+      exit(1);
+    }
+    writer->capacity = capacity;
+  }
+  memcpy(writer->bytes + writer->count, bytes, count);
+  writer->count += count;
+}
+
+static void writeU8(CacheWriter *writer, uint8_t value) {
+  writeBytes(writer, &value, 1);
+}
+
+static void writeU32(CacheWriter *writer, uint32_t value) {
+  uint8_t bytes[4];
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = (uint8_t)(value >> (8 * i));
+  }
+  writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(CacheWriter *writer, uint64_t value) {
+  writeU32(writer, (uint32_t)value);
+  writeU32(writer, (uint32_t)(value >> 32));
+}
+
+static void writePadding(CacheWriter *writer) {
+  static const uint8_t zeros[4] = {0};
+  writeBytes(writer, zeros, (4 - writer->count % 4) % 4);
+}
+
+static void writeString(CacheWriter *writer, ObjString *string) {
+  writeU32(writer, (uint32_t)string->length);
+  writeBytes(writer, string->chars, string->length);
+}
+
+static void writeConstant(CacheWriter *writer, Value value) {
+  switch (value.type) {
+  case VAL_NIL:
+    writeU8(writer, CONST_NIL);
+    break;
+  case VAL_BOOL:
+    writeU8(writer, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+    break;
+  case VAL_NUMBER:
+    uint64_t bits;
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(bits));
+    writeU8(writer, CONST_NUMBER);
+    writeU64(writer, bits);
+    break;
+  case VAL_OBJ:
+    if (IS_FUNCTION(value)) {
+      writeU8(writer, CONST_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(value));
+    } else {
+      writeU8(writer, CONST_STRING);
+      writeString(writer, flatString(AS_OBJ(value)));
+    }
+    break;
+  }
+}
+
+static void writeFunction(CacheWriter *writer, ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  writeU32(writer, (uint32_t)function->arity);
+  writeU32(writer, (uint32_t)function->upvalue_count);
+  if (function->name == NULL) {
+    writeU32(writer, CACHE_NO_NAME);
+  } else {
+    writeString(writer, function->name);
+  }
+  writeU32(writer, (uint32_t)chunk->count);
+  writeBytes(writer, chunk->code, chunk->count);
+  writePadding(writer);
+  for (int i = 0; i < chunk->count; i++) {
+    writeU32(writer, chunk->lines[i]);
+  }
+  writeU32(writer, chunk->constants.count);
+  for (uint32_t i = 0; i < chunk->constants.count; i++) {
+    writeConstant(writer, chunk->constants.values[i]);
+  }
+}
+
+void encodeCache(CacheWriter *writer, ObjFunction *function,
+                 uint64_t source_hash) {
+  writeBytes(writer, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+  writeU32(writer, CACHE_VERSION);
+  writeU32(writer, 0);
+  writeU64(writer, source_hash);
+  writeU32(writer, vm.selector_names.count);
+  for (uint32_t i = 0; i < vm.selector_names.count; i++) {
+    writeString(writer, SELECTOR_NAME(i));
+  }
+  writeFunction(writer, function);
+}
+
+bool writeCache(const char *path, ObjFunction *function, uint64_t source_hash) {
+  CacheWriter writer = {NULL, 0, 0};
+  encodeCache(&writer, function, source_hash);
+
+  // 先写临时文件再改名, 别的进程不会读到写了一半的缓存
+  size_t length = strlen(path);
+  char *temp = (char *)malloc(length + 5);
+  if (temp == NULL) {
+    exit(1);
+  }
+  memcpy(temp, path, length);
+  memcpy(temp + length, ".tmp", 5);
+  FILE *file = fopen(temp, "wb");
+  bool ok = file != NULL;
+  if (ok) {
+    ok = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temp, path) == 0;
+    if (!ok) {
+      remove(temp);
+    }
+  }
+  free(temp);
+  free(writer.bytes);
+  return ok;
+}
+
+static const uint8_t *readBytes(CacheReader *reader, size_t count) {
+  if (!reader->ok || count > (size_t)(reader->end - reader->current)) {
+    reader->ok = false;
+    return NULL;
+  }
+  const uint8_t *bytes = reader->current;
+  reader->current += count;
+  return bytes;
+}
+
+static void skipPadding(CacheReader *reader) {
+  readBytes(reader, (4 - (size_t)(reader->current - reader->base) % 4) % 4);
+}
+
+static uint8_t readU8(CacheReader *reader) {
+  const uint8_t *bytes = readBytes(reader, 1);
+  return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t decodeU32(const uint8_t *bytes) {
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint32_t readU32(CacheReader *reader) {
+  const uint8_t *bytes = readBytes(reader, 4);
+  return bytes == NULL ? 0 : decodeU32(bytes);
+}
+
+static uint64_t readU64(CacheReader *reader) {
+  uint64_t low = readU32(reader);
+  return low | (uint64_t)readU32(reader) << 32;
+}
+
+static ObjString *readString(CacheReader *reader, uint32_t length) {
+  const char *chars = (const char *)readBytes(reader, length);
+  if (chars == NULL || length > INT32_MAX) {
+    reader->ok = false;
+    return NULL;
+  }
+  return copyString(chars, (int)length);
+}
+
+static bool readConstant(CacheReader *reader, Value *value) {
+  switch (readU8(reader)) {
+  case CONST_NIL:
+    *value = NIL_VAL;
+    break;
+  case CONST_FALSE:
+    *value = BOOL_VAL(false);
+    break;
+  case CONST_TRUE:
+    *value = BOOL_VAL(true);
+    break;
+  case CONST_NUMBER:
+    uint64_t bits = readU64(reader);
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    *value = NUMBER_VAL(number);
+    break;
+  case CONST_STRING:
+    ObjString *string = readString(reader, readU32(reader));
+    *value = OBJ_VAL(string);
+    break;
+  case CONST_FUNCTION:
+    ObjFunction *function = readFunction(reader);
+    *value = OBJ_VAL(function);
+    break;
+  default:
+    reader->ok = false;
+    break;
+  }
+  return reader->ok;
+}
+
+// 名字类的操作数必须指向字符串常量
+static bool nameOperand(Chunk *chunk, uint8_t *code) {
+  uint32_t index = code[0] >= OP_CONSTANT_LONG ? readLongOperand(code + 1)
+                                               : code[1];
+  return index < chunk->constants.count &&
+         IS_STRING(chunk->constants.values[index]);
+}
+
+static bool selectorOperand(CacheReader *reader, uint8_t *code) {
+  uint32_t selector = (uint32_t)(code[1] << 8 | code[2]);
+  if (selector >= reader->selector_count ||
+      reader->selectors[selector] > UINT16_MAX) {
+    return false;
+  }
+  uint32_t remapped = (uint32_t)reader->selectors[selector];
+  if (remapped != selector) { // 没变就不写, 映射的 page 保持共享
+    code[1] = (uint8_t)(remapped >> 8);
+    code[2] = (uint8_t)remapped;
+  }
+  return true;
+}
+
+// 按顺序走一遍指令, 换算 selector 并检查操作数, 坏掉的缓存不能让 VM 越界.
+// depth 是当前帧里至少有几个值 (slot 0 是函数自己), 局部变量下标不能超过它;
+// break/continue 跳走时不弹局部变量, 所以汇合处取较小的那个.
+// high 是不算往回跳时最多有几个值, VM 在调用和往回跳时留够 FRAME_STACK_MAX
+static bool checkCode(CacheReader *reader, ObjFunction *function,
+                      CodeFlow *flow) {
+  Chunk *chunk = &function->chunk;
+  int depth = function->arity + 1;
+  int high = depth;
+  bool falls = true; // 上一条指令会不会顺序执行到这一条
+  for (int offset = 0; offset < chunk->count;) {
+    int low = flow->lows[offset];
+    if (low >= 0 && falls) {
+      depth = depth < low ? depth : low;
+      high = high > flow->highs[offset] ? high : flow->highs[offset];
+    } else if (low >= 0) {
+      depth = low;
+      high = flow->highs[offset];
+    }
+    flow->depths[offset] = depth;
+    uint8_t *code = chunk->code + offset;
+    int rest = chunk->count - offset;
+    if (code[0] > OP_IMPORT_LONG) {
+      return false;
+    }
+    // instructionLength 要读 closure 引用的函数, 先确认它存在
+    if (code[0] == OP_CLOSURE || code[0] == OP_CLOSURE_LONG) {
+      bool is_long = code[0] == OP_CLOSURE_LONG;
+      if (rest < (is_long ? 4 : 2)) {
+        return false;
+      }
+      uint32_t index = is_long ? readLongOperand(code + 1) : code[1];
+      if (index >= chunk->constants.count ||
+          !IS_FUNCTION(chunk->constants.values[index])) {
+        return false;
+      }
+    }
+    int length = instructionLength(chunk, offset);
+    if (length <= 0 || length > rest) {
+      return false;
+    }
+
+    int pops = 0;
+    int pushes = 0;
+    int jump = 0;
+    falls = true;
+    switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      uint32_t constant = code[0] == OP_CONSTANT_LONG
+                              ? readLongOperand(code + 1)
+                              : code[1];
+      if (constant >= chunk->constants.count) {
+        return false;
+      }
+      pushes = 1;
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      pushes = 1;
+      break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_INHERIT:
+      pops = 2;
+      pushes = 1;
+      break;
+    case OP_NEGATE:
+    case OP_NOT:
+      pops = 1;
+      pushes = 1;
+      break;
+    case OP_PRINT:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+      pops = 1;
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      pops = 1;
+      if (!nameOperand(chunk, code)) {
+        return false;
+      }
+      break;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_IMPORT:
+    case OP_IMPORT_LONG:
+      pushes = 1;
+      if (!nameOperand(chunk, code)) {
+        return false;
+      }
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+      pops = 1;
+      pushes = 1;
+      if (!nameOperand(chunk, code)) {
+        return false;
+      }
+      break;
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+      pops = 2;
+      pushes = 1;
+      if (!nameOperand(chunk, code)) {
+        return false;
+      }
+      break;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      if (code[1] >= depth) {
+        return false;
+      }
+      pops = code[0] == OP_SET_LOCAL;
+      pushes = 1;
+      break;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      if (code[1] >= function->upvalue_count) {
+        return false;
+      }
+      pops = code[0] == OP_SET_UPVALUE;
+      pushes = 1;
+      break;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      int pairs = code[0] == OP_CLOSURE_LONG ? 4 : 2;
+      for (int i = pairs; i < length; i += 2) {
+        uint8_t is_local = code[i];
+        uint8_t index = code[i + 1];
+        if (is_local > 1 || (is_local && index >= depth) ||
+            (!is_local && index >= function->upvalue_count)) {
+          return false;
+        }
+      }
+      pushes = 1;
+      break;
+    case OP_JUMP_IF_FALSE:
+      pops = 1;
+      pushes = 1;
+      jump = (code[1] << 8 | code[2]) + 3;
+      break;
+    case OP_JUMP:
+      jump = (code[1] << 8 | code[2]) + 3;
+      falls = false;
+      break;
+    case OP_LOOP:
+      jump = 3 - (code[1] << 8 | code[2]);
+      falls = false;
+      break;
+    case OP_CALL:
+      pops = code[1] + 1;
+      pushes = 1;
+      break;
+    case OP_METHOD:
+    case OP_GET_SUPER:
+      pops = 2;
+      pushes = 1;
+      if (!selectorOperand(reader, code)) {
+        return false;
+      }
+      break;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      pops = code[3] + (code[0] == OP_SUPER_INVOKE ? 2 : 1);
+      pushes = 1;
+      if (!selectorOperand(reader, code)) {
+        return false;
+      }
+      break;
+    case OP_RETURN:
+      pops = 1;
+      falls = false;
+      break;
+    }
+    // slot 0 不能弹出
+    if (depth - pops < (pushes > 0 ? 0 : 1)) {
+      return false;
+    }
+    depth += pushes - pops;
+    high += pushes - pops;
+    if (high > FRAME_STACK_MAX) {
+      return false;
+    }
+
+    if (jump > 0 && code[0] != OP_LOOP) {
+      int target = offset + jump;
+      if (target >= chunk->count) {
+        return false;
+      }
+      if (flow->lows[target] < 0) {
+        flow->lows[target] = depth;
+        flow->highs[target] = high;
+      } else {
+        flow->lows[target] =
+            depth < flow->lows[target] ? depth : flow->lows[target];
+        flow->highs[target] =
+            high > flow->highs[target] ? high : flow->highs[target];
+      }
+    } else if (code[0] == OP_LOOP) {
+      // 往回跳的目标已经走过, 那里假定的深度不能比现在多
+      int target = offset + jump;
+      if (target < 0 || flow->depths[target] < 0 ||
+          depth < flow->depths[target]) {
+        return false;
+      }
+    }
+    offset += length;
+  }
+  if (falls) {
+    return false; // 最后一条指令之后没有代码了
+  }
+  for (int i = 0; i < chunk->count; i++) {
+    if (flow->lows[i] >= 0 && flow->depths[i] < 0) {
+      return false; // 跳进了指令中间
+    }
+  }
+  return true;
+}
+
+static bool verifyFunction(CacheReader *reader, ObjFunction *function) {
+  int count = function->chunk.count;
+  int *bytes = (int *)malloc(sizeof(int) * 3 * (size_t)count);
+  if (bytes == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < 3 * count; i++) {
+    bytes[i] = -1;
+  }
+  CodeFlow flow = {bytes, bytes + count, bytes + 2 * count};
+  bool ok = checkCode(reader, function, &flow);
+  free(bytes);
+  return ok;
+}
+
+static ObjFunction *readFunction(CacheReader *reader) {
+  ObjFunction *function = newFunction();
+  push(OBJ_VAL(function)); // GC
+  uint32_t arity = readU32(reader);
+  uint32_t upvalue_count = readU32(reader);
+  // 和编译器的上限一致, 也限制函数常量的嵌套, 每层都占一个栈槽
+  if (arity > UINT8_MAX || upvalue_count > UINT8_COUNT ||
+      reader->depth >= CACHE_MAX_NESTING) {
+    reader->ok = false;
+  } else {
+    function->arity = (int)arity;
+    function->upvalue_count = (int)upvalue_count;
+  }
+  reader->depth += 1;
+  uint32_t name_length = readU32(reader);
+  if (name_length != CACHE_NO_NAME) {
+    function->name = readString(reader, name_length);
+  }
+
+  Chunk *chunk = &function->chunk;
+  uint32_t count = readU32(reader);
+  const uint8_t *code = readBytes(reader, count);
+  skipPadding(reader);
+  const uint8_t *lines = readBytes(reader, (size_t)count * 4);
+  if (reader->ok && count > 0 && count <= INT32_MAX) {
+    chunk->capacity = (int)count;
+    chunk->count = (int)count;
+    if (reader->zero_copy) {
+      chunk->code = (uint8_t *)code;
+      chunk->lines = (uint32_t *)lines;
+      function->obj.flags |= OBJ_MAPPED;
+    } else {
+      chunk->code = ALLOCATE(uint8_t, count);
+      chunk->lines = ALLOCATE(uint32_t, count);
+      memcpy(chunk->code, code, count);
+      for (uint32_t i = 0; i < count; i++) {
+        chunk->lines[i] = decodeU32(lines + 4 * i);
+      }
+    }
+  } else {
+    reader->ok = false;
+  }
+
+  uint32_t constant_count = readU32(reader);
+  for (uint32_t i = 0; i < constant_count && reader->ok; i++) {
+    Value value;
+    if (readConstant(reader, &value)) {
+      addConstant(chunk, value);
+    }
+  }
+  if (reader->ok && !verifyFunction(reader, function)) {
+    reader->ok = false;
+  }
+  reader->depth -= 1;
+  pop();
+  return reader->ok ? function : NULL;
+}
+
+bool isCacheFile(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+  char magic[CACHE_MAGIC_SIZE];
+  bool result = fread(magic, 1, CACHE_MAGIC_SIZE, file) == CACHE_MAGIC_SIZE &&
+                memcmp(magic, CACHE_MAGIC, CACHE_MAGIC_SIZE) == 0;
+  fclose(file);
+  return result;
+}
+
+// mapping 为 NULL 时 reader 必须是复制模式
+static ObjFunction *readImage(CacheReader *reader, uint64_t source_hash,
+                              void *mapping, size_t size) {
+  const uint8_t *magic = readBytes(reader, CACHE_MAGIC_SIZE);
+  if (magic == NULL || memcmp(magic, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0 ||
+      readU32(reader) != CACHE_VERSION) {
+    reader->ok = false;
+  }
+  readU32(reader);
+  uint64_t hash = readU64(reader);
+  if (source_hash != 0 && hash != source_hash) {
+    reader->ok = false; // 源文件改过了
+  }
+
+  uint32_t selector_count = readU32(reader);
+  if (reader->ok &&
+      selector_count <= (size_t)(reader->end - reader->current) / 4) {
+    reader->selectors = (int *)malloc(sizeof(int) * (selector_count + 1));
+    if (reader->selectors == NULL) {
+      exit(1);
+    }
+    bool remap = false;
+    for (uint32_t i = 0; i < selector_count && reader->ok; i++) {
+      ObjString *name = readString(reader, readU32(reader));
+      if (name != NULL) {
+        reader->selectors[i] = methodSelector(name);
+        remap = remap || reader->selectors[i] != (int)i;
+      }
+    }
+    reader->selector_count = selector_count;
+    // 只有 selector 编号对不上时才需要改 code, 改到的 page 写时复制
+    if (remap && reader->zero_copy &&
+        mprotect(mapping, size, PROT_READ | PROT_WRITE) != 0) {
+      reader->ok = false;
+    }
+  } else {
+    reader->ok = false;
+  }
+
+  ObjFunction *function = reader->ok ? readFunction(reader) : NULL;
+  // 顶层脚本没有参数, 也没有 upvalue 可捕获
+  if (reader->current != reader->end ||
+      (function != NULL &&
+       (function->arity != 0 || function->upvalue_count != 0))) {
+    function = NULL;
+  }
+  free(reader->selectors);
+  return function;
+}
+
+ObjFunction *loadCache(const char *path, uint64_t source_hash) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)info.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  const uint8_t *base = (const uint8_t *)mapping;
+  uint16_t one = 1;
+  CacheReader reader = {.base = base,
+                        .current = base,
+                        .end = base + size,
+                        .ok = true,
+                        .zero_copy = *(uint8_t *)&one == 1,
+                        .selectors = NULL,
+                        .selector_count = 0,
+                        .depth = 0};
+  ObjFunction *function = readImage(&reader, source_hash, mapping, size);
+  if (function == NULL || !reader.zero_copy) {
+    munmap(mapping, size);
+    return function;
+  }
+  mprotect(mapping, size, PROT_READ);
+
+  CacheImage *image = (CacheImage *)malloc(sizeof(CacheImage));
+  if (image == NULL) {
+    exit(1);
+  }
+  image->base = mapping;
+  image->size = size;
+  image->next = vm.images;
+  vm.images = image;
+  return function;
+}
+
+ObjFunction *decodeCache(const uint8_t *bytes, size_t size) {
+  CacheReader reader = {.base = bytes,
+                        .current = bytes,
+                        .end = bytes + size,
+                        .ok = true,
+                        .zero_copy = false,
+                        .selectors = NULL,
+                        .selector_count = 0,
+                        .depth = 0};
+  return readImage(&reader, 0, NULL, 0);
+}
+
+// 引用映射的函数都已经释放之后调用
+void freeCacheImages() {
+  CacheImage *image = vm.images;
+  while (image != NULL) {
+    CacheImage *next = image->next;
+    munmap(image->base, image->size);
+    free(image);
+    image = next;
+  }
+  vm.images = NULL;
+}
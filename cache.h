@@ -0,0 +1,65 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+// 编译结果的二进制缓存 (.cloxc), 启动时跳过扫描和编译
+#include "common.h"
+#include "object.h"
+#include <stdint.h>
+
+#define CACHE_MAGIC "CLOXC\0\0\0"
+#define CACHE_MAGIC_SIZE 8
+#define CACHE_VERSION 4 // 指令编码或文件格式变了就加一
+#define CACHE_EXTENSION ".cloxc"
+
+typedef struct {
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+} CacheWriter;
+
+// 载入后一直映射着, 函数的 code 和 lines 直接指向这里
+typedef struct CacheImage {
+  struct CacheImage *next;
+  void *base;
+  size_t size;
+} CacheImage;
+
+typedef struct {
+  const uint8_t *base;
+  const uint8_t *current;
+  const uint8_t *end;
+  bool ok;
+  bool zero_copy;
+  // 文件里的 selector 编号 -> 本 VM 的编号
+  int *selectors;
+  uint32_t selector_count;
+  int depth; // 正在读的函数常量嵌套了几层
+} CacheReader;
+
+// checkCode 的工作区, 都按字节偏移下标, -1 表示还没有
+typedef struct {
+  int *depths; // 走到这条指令时栈上至少有几个值
+  int *lows;   // 跳到这里的跳转里最少的
+  int *highs;  // 跳到这里的跳转里最多的
+} CodeFlow;
+
+uint64_t hashSource(const char *source, size_t length);
+bool isCacheFile(const char *path);
+bool writeCache(const char *path, ObjFunction *function, uint64_t source_hash);
+// 和 writeCache 同样的格式, 只是留在内存里
+void encodeCache(CacheWriter *writer, ObjFunction *function,
+                 uint64_t source_hash);
+// source_hash 为 0 时不检查源文件, 直接运行缓存
+ObjFunction *loadCache(const char *path, uint64_t source_hash);
+// 从内存复制进本 VM, 字符串常量在 intern 表里去重
+ObjFunction *decodeCache(const uint8_t *bytes, size_t size);
+void freeCacheImages();
+static void writeFunction(CacheWriter *writer, ObjFunction *function);
+static ObjFunction *readFunction(CacheReader *reader);
+static ObjFunction *readImage(CacheReader *reader, uint64_t source_hash,
+                              void *mapping, size_t size);
+static bool nameOperand(Chunk *chunk, uint8_t *code);
+static bool selectorOperand(CacheReader *reader, uint8_t *code);
+static bool checkCode(CacheReader *reader, ObjFunction *function,
+                      CodeFlow *flow);
+static bool verifyFunction(CacheReader *reader, ObjFunction *function);
+#endif
@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 #include <stdint.h>
@@ -44,4 +45,50 @@ uint32_t addConstant(Chunk *chunk, Value value) {
   pop(); //GC
   // 返回常量在常量池的index
   return chunk->constants.count - 1;
+}
+
+// 指令连同操作数的字节数
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_CALL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CLASS:
+  case OP_SET_PROPERTY:
+  case OP_GET_PROPERTY:
+  case OP_IMPORT:
+    return 2;
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP:
+  case OP_LOOP:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+    return 3;
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_CONSTANT_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_CLASS_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_PROPERTY_LONG:
+  case OP_IMPORT_LONG:
+    return 4;
+  case OP_CLOSURE:
+    Value function = chunk->constants.values[chunk->code[offset + 1]];
+    return 2 + 2 * AS_FUNCTION(function)->upvalue_count;
+  case OP_CLOSURE_LONG:
+    uint32_t index = readLongOperand(chunk->code + offset + 1);
+    Value long_function = chunk->constants.values[index];
+    return 4 + 2 * AS_FUNCTION(long_function)->upvalue_count;
+  default:
+    return 1;
+  }
 }
\ No newline at end of file
@@ -43,8 +43,25 @@ typedef enum {
   OP_INHERIT,
   OP_GET_SUPER,
   OP_SUPER_INVOKE,
+  OP_IMPORT,
+  // 常量下标放不进一个字节时的版本, 操作数 24 位大端
+  OP_CONSTANT_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_CLOSURE_LONG,
+  OP_CLASS_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_IMPORT_LONG,
 } Opcode;
 
+#define CONSTANT_LONG_MAX 0xffffff // 每个 chunk 最多这么多常量
+
+static inline uint32_t readLongOperand(const uint8_t *code) {
+  return (uint32_t)code[0] << 16 | (uint32_t)code[1] << 8 | code[2];
+}
+
 // Chunk 保存所有指令
 // 指令动态数组， code指针指向的内存地址
 // count 已使用
@@ -62,4 +79,5 @@ void initChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, uint32_t line);
 void freeChunk(Chunk *chunk);
 uint32_t addConstant(Chunk *chunk, Value value);
+int instructionLength(Chunk *chunk, int offset);
 #endif
@@ -10,4 +10,6 @@
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#define GC_COMPACT // 碎片过多时整理堆
+// #define DEBUG_STRESS_COMPACT // 每次 GC 后都在下一个 safe point 整理
 #endif
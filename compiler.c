@@ -5,6 +5,7 @@
 #include "object.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,36 +16,33 @@
 #include "debug.h"
 #endif
 
-typedef struct {
-  Token current;
-  Token previous;
-  bool is_for_while;
-  bool hadError;
-  bool panicMode;
-} Parser;
-
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *current_class = NULL;
-Break *head = NULL, *tail = NULL;
-Continue *c_head = NULL, *c_tail = NULL;
-
-static Chunk *currentChunk() { return &current->function->chunk; }
+static Chunk *currentChunk(Parser *parser) {
+  return &parser->compiler->function->chunk;
+}
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
-  compiler->enclosing = current;
+// function 不为 NULL 时接着编译预扫描过的函数
+static void initCompiler(Parser *parser, Compiler *compiler,
+                         FunctionType type, ObjFunction *function) {
+  compiler->enclosing = parser->compiler;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
   compiler->type = type;
-  compiler->function = newFunction();
-  current = compiler;
+  compiler->constants = NULL;
+  compiler->constant_count = 0;
+  compiler->constant_capacity = 0;
+  compiler->function = function != NULL ? function : newFunction();
+  if (function == NULL && compiler->enclosing != NULL) {
+    // 延迟编译时外层函数已经知道自己在哪个文件里
+    compiler->function->module = compiler->enclosing->function->module;
+  }
+  parser->compiler = compiler;
 
-  if (type == TYPE_FUNCTION) {
-    current->function->name =
-        copyString(parser.previous.start, parser.previous.length);
+  if (type == TYPE_FUNCTION && function == NULL) {
+    parser->compiler->function->name =
+        copyString(parser->previous.start, parser->previous.length);
   }
 
-  Local *local = &current->locals[current->localCount++];
+  Local *local = &parser->compiler->locals[parser->compiler->localCount++];
   local->depth = 0;
   local->is_captured = false;
 
@@ -57,26 +55,26 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   }
 }
 
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many variables in function.");
+static void addLocal(Parser *parser, Token name) {
+  if (parser->compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many variables in function.");
     return;
   }
   // fprintf(stderr, "=======> '%.*s' \n", name.length, name.start);
   Local local;
   local.name = name;
-  // local.depth = current->scopeDepth;
+  // local.depth = parser->compiler->scopeDepth;
   local.depth = -1;
   local.is_captured = false;
-  current->locals[current->localCount] = local;
-  current->localCount += 1;
+  parser->compiler->locals[parser->compiler->localCount] = local;
+  parser->compiler->localCount += 1;
 }
 
-static void errorAt(Token *token, const char *msg) {
-  if (parser.panicMode) {
+static void errorAt(Parser *parser, Token *token, const char *msg) {
+  if (parser->panicMode) {
     return;
   }
-  parser.panicMode = true;
+  parser->panicMode = true;
 
   fprintf(stderr, "[line %d] Error", token->line);
   if (token->type == TOKEN_EOF) {
@@ -88,23 +86,25 @@ static void errorAt(Token *token, const char *msg) {
   }
 
   fprintf(stderr, ": %s\n", msg);
-  parser.hadError = true;
+  parser->hadError = true;
 }
 
-static void errorAtCurrent(const char *messaeg) {
-  errorAt(&parser.current, messaeg);
+static void errorAtCurrent(Parser *parser, const char *messaeg) {
+  errorAt(parser, &parser->current, messaeg);
 }
 
-static void error(const char *message) { errorAt(&parser.previous, message); }
+static void error(Parser *parser, const char *message) {
+  errorAt(parser, &parser->previous, message);
+}
 
 // painc synchronize
-static void synchronize() {
-  parser.panicMode = false;
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) {
+static void synchronize(Parser *parser) {
+  parser->panicMode = false;
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) {
       return;
     }
-    switch (parser.current.type) {
+    switch (parser->current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
     case TOKEN_FOR:
@@ -113,255 +113,389 @@ static void synchronize() {
     case TOKEN_WHILE:
     case TOKEN_PRINT:
     case TOKEN_RETURN:
+    case TOKEN_IMPORT:
       return;
     default:
       break;
     }
-    advance();
+    advance(parser);
   }
 }
 
 // advance 前进
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser *parser) {
+  parser->previous = parser->current;
+  parser->previous_number = parser->scanner.number; // 还没扫下一个 token
   for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) {
+    parser->current = scanToken(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR) {
       break;
     }
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
 // 消费 token
-static void consume(TokenType type, const char *message) {
+static void consume(Parser *parser, TokenType type, const char *message) {
   // skip current token
-  if (parser.current.type == type) {
-    advance();
+  if (parser->current.type == type) {
+    advance(parser);
   } else {
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
   }
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser *parser, uint8_t byte) {
+  writeChunk(currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t opcode, uint8_t byte2) {
-  emitByte(opcode);
-  emitByte(byte2);
+static void emitBytes(Parser *parser, uint8_t opcode, uint8_t byte2) {
+  emitByte(parser, opcode);
+  emitByte(parser, byte2);
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff); // u16
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+static int emitJump(Parser *parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitByte(parser, 0xff); // u16
+  emitByte(parser, 0xff);
+  return currentChunk(parser)->count - 2;
 }
 // 88 -81 -2 = 5
-static void patchJump(int offset) {
-  int jump = currentChunk()->count - offset - 2;
+static void patchJump(Parser *parser, int offset) {
+  int jump = currentChunk(parser)->count - offset - 2;
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    error(parser, "Too much code to jump over.");
   }
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
-  int offset = currentChunk()->count - loopStart + 2;
+static void emitLoop(Parser *parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
+  int offset = currentChunk(parser)->count - loopStart + 2;
   if (offset > UINT16_MAX) {
-    error("loop body too large");
+    error(parser, "loop body too large");
   }
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
 }
 
-static void emitReturn() {
-  if (current->type == TYPE_INITIALIZER) {
-    emitBytes(OP_GET_LOCAL, 0);
-    emitByte(OP_RETURN);
+static void emitReturn(Parser *parser) {
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);
+    emitByte(parser, OP_RETURN);
   } else {
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_NIL);
+    emitByte(parser, OP_RETURN);
   }
 }
 
-static uint8_t makeConstant(Value value) {
-  int constantIndex = addConstant(currentChunk(), value);
-  if (constantIndex > UINT8_MAX) {
-    error("too many constant in one chunk.");
+static uint32_t makeConstant(Parser *parser, Value value) {
+  uint32_t constantIndex = addConstant(currentChunk(parser), value);
+  if (constantIndex > CONSTANT_LONG_MAX) {
+    error(parser, "too many constant in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constantIndex;
+  return constantIndex;
+}
+
+static void freeConstantSlots(Compiler *compiler) {
+  free(compiler->constants);
+  compiler->constants = NULL;
+  compiler->constant_count = 0;
+  compiler->constant_capacity = 0;
+}
+
+static ConstantSlot *findConstantSlot(ConstantSlot *slots, int capacity,
+                                      uint64_t bits, uint8_t type) {
+  uint32_t mask = (uint32_t)capacity - 1;
+  uint32_t index = (uint32_t)((bits * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+  while (slots[index].index != CONSTANT_SLOT_EMPTY &&
+         (slots[index].bits != bits || slots[index].type != type)) {
+    index = (index + 1) & mask;
+  }
+  return &slots[index];
+}
+
+// 同一个函数里相同的数字和字符串共用一个常量; 字符串已 intern, 比较指针
+static uint32_t uniqueConstant(Parser *parser, Value value) {
+  Compiler *compiler = parser->compiler;
+  if ((compiler->constant_count + 1) * 4 > compiler->constant_capacity * 3) {
+    int capacity = compiler->constant_capacity < 16
+                       ? 16
+                       : compiler->constant_capacity * 2;
+    ConstantSlot *slots =
+        (ConstantSlot *)malloc(sizeof(ConstantSlot) * capacity);
+    if (slots == NULL) {
+      exit(1);
+    }
+    for (int i = 0; i < capacity; i++) {
+      slots[i].index = CONSTANT_SLOT_EMPTY;
+    }
+    for (int i = 0; i < compiler->constant_capacity; i++) {
+      ConstantSlot *old = &compiler->constants[i];
+      if (old->index != CONSTANT_SLOT_EMPTY) {
+        *findConstantSlot(slots, capacity, old->bits, old->type) = *old;
+      }
+    }
+    free(compiler->constants);
+    compiler->constants = slots;
+    compiler->constant_capacity = capacity;
+  }
+
+  uint64_t bits;
+  if (value.type == VAL_NUMBER) {
+    memcpy(&bits, &value.as.number, sizeof(bits));
+  } else {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  }
+  ConstantSlot *slot = findConstantSlot(
+      compiler->constants, compiler->constant_capacity, bits, value.type);
+  if (slot->index == CONSTANT_SLOT_EMPTY) {
+    slot->bits = bits;
+    slot->type = value.type;
+    slot->index = makeConstant(parser, value);
+    compiler->constant_count += 1;
+  }
+  return slot->index;
+}
+
+static uint8_t longOpcode(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+    return OP_CONSTANT_LONG;
+  case OP_DEFINE_GLOBAL:
+    return OP_DEFINE_GLOBAL_LONG;
+  case OP_GET_GLOBAL:
+    return OP_GET_GLOBAL_LONG;
+  case OP_SET_GLOBAL:
+    return OP_SET_GLOBAL_LONG;
+  case OP_CLOSURE:
+    return OP_CLOSURE_LONG;
+  case OP_CLASS:
+    return OP_CLASS_LONG;
+  case OP_SET_PROPERTY:
+    return OP_SET_PROPERTY_LONG;
+  case OP_GET_PROPERTY:
+    return OP_GET_PROPERTY_LONG;
+  case OP_IMPORT:
+    return OP_IMPORT_LONG;
+  default:
+    // 新加的常量操作数指令要在这里登记 _LONG 版本
+    fprintf(stderr, "no long form for opcode %d.\n", op);
+    abort();
+  }
 }
 
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+// 下标放得进一个字节就用短指令, 否则换成 24 位操作数的 _LONG 版本
+static void emitConstantOp(Parser *parser, uint8_t op, uint32_t index) {
+  if (index <= UINT8_MAX) {
+    emitBytes(parser, op, (uint8_t)index);
+    return;
+  }
+  emitBytes(parser, longOpcode(op), (index >> 16) & 0xff);
+  emitBytes(parser, (index >> 8) & 0xff, index & 0xff);
 }
 
-static ObjFunction *endCompiler() {
-  emitReturn();
-  ObjFunction *function = current->function;
+static void emitConstant(Parser *parser, Value value) {
+  emitConstantOp(parser, OP_CONSTANT, uniqueConstant(parser, value));
+}
+
+static ObjFunction *endCompiler(Parser *parser) {
+  emitReturn(parser);
+  ObjFunction *function = parser->compiler->function;
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (!parser->hadError) {
     const char *fname =
         function->name != NULL ? function->name->chars : "<script>";
-    disassembleChunk(currentChunk(), fname);
+    disassembleChunk(currentChunk(parser), fname);
   }
 #endif
-  current = current->enclosing;
+  freeConstantSlots(parser->compiler);
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) {
+static bool match(Parser *parser, TokenType type) {
+  if (!check(parser, type)) {
     return false;
   } else {
-    advance();
+    advance(parser);
     return true;
   }
 }
 
-static bool check(TokenType type) { return parser.current.type == type; }
+static bool check(Parser *parser, TokenType type) {
+  return parser->current.type == type;
+}
 
-static void parsePrecedence(Precedence precedence) {
+static void parsePrecedence(Parser *parser, Precedence precedence) {
   // 1 ; eof
   // p c
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {
-    error("no match prefix function");
+    error(parser, "no match prefix function");
     return;
   }
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
+  parser->last_rule = prefixRule;
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, canAssign);
+    parser->last_rule = infixRule;
   }
 
-  if (!canAssign && match(TOKEN_EQUAL)) {
+  if (!canAssign && match(parser, TOKEN_EQUAL)) {
     // var a=1; var b = 2 + a = 1;
-    error("Invalid assignment target. example `var foo = 1 + bar = 1;`");
+    error(parser,
+          "Invalid assignment target. example `var foo = 1 + bar = 1;`");
   }
 }
 
-static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
+static void expression(Parser *parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);
+}
 
-static void declaration() {
-  if (match(TOKEN_VAR)) {
-    varDeclaration();
-  } else if (match(TOKEN_FUN)) {
-    funDeclaration();
-  } else if (match(TOKEN_CLASS)) {
-    classDeclaration();
+static void declaration(Parser *parser) {
+  if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
+  } else if (match(parser, TOKEN_FUN)) {
+    funDeclaration(parser);
+  } else if (match(parser, TOKEN_CLASS)) {
+    classDeclaration(parser);
   } else {
-    statement();
-  }
-  if (parser.panicMode) {
-    synchronize();
-  }
-}
-
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_IF)) {
-    ifStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
-  } else if (match(TOKEN_WHILE)) {
-    whileStatement();
-  } else if (match(TOKEN_FOR)) {
-    forStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_BREAK)) {
-    breakStatement();
-  } else if (match(TOKEN_CONTINUE)) {
-    continueStatement();
+    statement(parser);
+  }
+  if (parser->panicMode) {
+    synchronize(parser);
+  }
+}
+
+static void statement(Parser *parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOKEN_BREAK)) {
+    breakStatement(parser);
+  } else if (match(parser, TOKEN_CONTINUE)) {
+    continueStatement(parser);
+  } else if (match(parser, TOKEN_IMPORT)) {
+    importStatement(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 }
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "expect `;` after value.");
-  emitByte(OP_PRINT);
+static void printStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "expect `;` after value.");
+  emitByte(parser, OP_PRINT);
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "expect `;` after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "expect `;` after expression.");
+  emitByte(parser, OP_POP);
 }
 
-static void varDeclaration() {
-  // parseVariable() return constant index
-  uint8_t global = parseVariable("expect variable name.");
-  if (match(TOKEN_EQUAL)) {
-    expression();
+static void varDeclaration(Parser *parser) {
+  // parseVariable(parser) return constant index
+  uint32_t global = parseVariable(parser, "expect variable name.");
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
-  consume(TOKEN_SEMICOLON, "expect `;` variable declaration.");
-  defineVariable(global);
+  consume(parser, TOKEN_SEMICOLON, "expect `;` variable declaration.");
+  defineVariable(parser, global);
 }
 
-static uint8_t parseVariable(const char *msg) {
-  consume(TOKEN_IDENTIFIER, msg);
-  declareVariable();
-  if (current->scopeDepth > 0) {
+static uint32_t parseVariable(Parser *parser, const char *msg) {
+  consume(parser, TOKEN_IDENTIFIER, msg);
+  declareVariable(parser);
+  if (parser->compiler->scopeDepth > 0) {
     return 0;
   }
   // global var
-  return identifierConstant(&parser.previous);
+  return identifierConstant(parser, &parser->previous);
 }
 
-static uint8_t identifierConstant(Token *token) {
-  return makeConstant(OBJ_VAL(copyString(token->start, token->length)));
+static uint32_t identifierConstant(Parser *parser, Token *token) {
+  return uniqueConstant(parser,
+                        OBJ_VAL(copyString(token->start, token->length)));
+}
+
+// 方法名不进常量表, 编译成全局 vtable 下标
+static uint16_t selectorIndex(Parser *parser, Token *token) {
+  int selector = methodSelector(copyString(token->start, token->length));
+  if (selector > UINT16_MAX) {
+    error(parser, "too many method names.");
+    return 0;
+  }
+  return (uint16_t)selector;
+}
+
+static void emitSelector(Parser *parser, uint8_t op, uint16_t selector) {
+  emitByte(parser, op);
+  emitBytes(parser, (selector >> 8) & 0xff, selector & 0xff);
 }
 
 // return bytecode
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(Parser *parser, uint32_t global) {
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser);
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitConstantOp(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static void markInitialized() {
-  if (current->scopeDepth == 0) {
+static void markInitialized(Parser *parser) {
+  if (parser->compiler->scopeDepth == 0) {
     return;
   }
-  current->locals[current->localCount - 1].depth = current->scopeDepth;
+  Compiler *compiler = parser->compiler;
+  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
 // local variable
-static void declareVariable() {
-  if (current->scopeDepth == 0) {
+static void declareVariable(Parser *parser) {
+  if (parser->compiler->scopeDepth == 0) {
     return;
   }
-  Token *name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local *local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
+  Token *name = &parser->previous;
+  for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &parser->compiler->locals[i];
+    if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
       break;
     }
     if (identifierEqual(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+      error(parser, "Already a variable with this name in this scope.");
     }
   }
-  addLocal(*name);
+  addLocal(parser, *name);
+}
+
+static Token syntheticToken(const char *text) {
+  Token token;
+  token.start = text;
+  token.length = (int)strlen(text);
+  return token;
 }
 
 static bool identifierEqual(Token *a, Token *b) {
@@ -371,399 +505,478 @@ static bool identifierEqual(Token *a, Token *b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Parser *parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
-  consume(TOKEN_RIGHT_BRACE, "expect `}` after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "expect `}` after block.");
 }
 
-static void beginScope() { current->scopeDepth += 1; }
+static void beginScope(Parser *parser) { parser->compiler->scopeDepth += 1; }
 
-static void endScope() {
-  current->scopeDepth -= 1;
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth > current->scopeDepth) {
+static void endScope(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  compiler->scopeDepth -= 1;
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth >
+             compiler->scopeDepth) {
     // bug?
-    if (current->locals[current->localCount - 1].is_captured) {
-      emitByte(OP_CLOSE_UPVALUE);
+    if (compiler->locals[compiler->localCount - 1].is_captured) {
+      emitByte(parser, OP_CLOSE_UPVALUE);
     } else {
-      emitByte(OP_POP);
+      emitByte(parser, OP_POP);
     }
-    current->localCount -= 1;
+    compiler->localCount -= 1;
   }
 }
 
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "expect `(` after if.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "expect `)` after condition.");
+static void ifStatement(Parser *parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "expect `(` after if.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "expect `)` after condition.");
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
   // true
-  emitByte(OP_POP);
-  statement();
+  emitByte(parser, OP_POP);
+  statement(parser);
   // }
-  int elseJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(parser, OP_JUMP);
 
   // 回填正确的跳转操作数
-  patchJump(thenJump);
+  patchJump(parser, thenJump);
 
   // else
-  emitByte(OP_POP);
-  if (match(TOKEN_ELSE)) {
-    statement();
+  emitByte(parser, OP_POP);
+  if (match(parser, TOKEN_ELSE)) {
+    statement(parser);
   }
-  patchJump(elseJump);
+  patchJump(parser, elseJump);
 }
 
-static void whileStatement() {
+static void whileStatement(Parser *parser) {
   // break/continue
-  parser.is_for_while = true;
+  parser->is_for_while = true;
   // continue statement
   Continue *cur = (Continue *)malloc(sizeof(Continue));
   // 往回跳位置 L1:
   //              vvv bytes len.
-  int loopStart = currentChunk()->count;
-  consume(TOKEN_LEFT_PAREN, "expect `(` after while.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "expect `)` after while.");
+  int loopStart = currentChunk(parser)->count;
+  consume(parser, TOKEN_LEFT_PAREN, "expect `(` after while.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "expect `)` after while.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
 
-  if (match(TOKEN_COLON)) {
-    consume(TOKEN_LEFT_PAREN, "expect `(` after `:`.");
+  if (match(parser, TOKEN_COLON)) {
+    consume(parser, TOKEN_LEFT_PAREN, "expect `(` after `:`.");
     // Increment clause
-    int boodJump = emitJump(OP_JUMP); // skip exprssion
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "expect `)` after for clauses.");
-    emitLoop(loopStart);
+    int boodJump = emitJump(parser, OP_JUMP); // skip exprssion
+    int incrementStart = currentChunk(parser)->count;
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "expect `)` after for clauses.");
+    emitLoop(parser, loopStart);
     loopStart = incrementStart;
-    patchJump(boodJump);
+    patchJump(parser, boodJump);
     
     //continue statement
     cur->patch_continue = incrementStart;
     cur->next = NULL;
-    if (c_head == NULL) {
-      c_head = cur;
+    if (parser->c_head == NULL) {
+      parser->c_head = cur;
     } else {
-      c_tail->next = cur;
+      parser->c_tail->next = cur;
     }
-    c_tail = cur;
+    parser->c_tail = cur;
   } else {
     //continue statement
     cur->patch_continue = loopStart;
     cur->next = NULL;
-    if (c_head == NULL) {
-      c_head = cur;
+    if (parser->c_head == NULL) {
+      parser->c_head = cur;
     } else {
-      c_tail->next = cur;
+      parser->c_tail->next = cur;
     }
-    c_tail = cur;
+    parser->c_tail = cur;
   }
   
   //{
-  statement();
-  emitLoop(loopStart);
+  statement(parser);
+  emitLoop(parser, loopStart);
 
-  patchJump(exitJump);
-  emitByte(OP_POP); // pop false value
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP); // pop false value
 
   // break patch
-  Break *temp = head;
+  Break *temp = parser->head;
   Break *last = NULL;
 
-  if (head != NULL) {
+  if (parser->head != NULL) {
     while (temp->next != NULL) {
       last = temp;
       temp = temp->next;
     }
 
     if (last == NULL) {
-      patchJump(temp->patch_break);
+      patchJump(parser, temp->patch_break);
     } else {
-      patchJump(last->next->patch_break);
-      tail = last;
+      patchJump(parser, last->next->patch_break);
+      parser->tail = last;
       last->next = NULL;
       free(temp);
     }
   }
   
-  parser.is_for_while = false;  
+  parser->is_for_while = false;  
 }
 
-static void forStatement() {
-  parser.is_for_while = true;
+static void forStatement(Parser *parser) {
+  parser->is_for_while = true;
 
-  beginScope();
-  consume(TOKEN_LEFT_PAREN, "expect `(` after for.");
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "expect `(` after for.");
   // init , var foo = 0;
-  if (match(TOKEN_SEMICOLON)) {
+  if (match(parser, TOKEN_SEMICOLON)) {
     // no initializer
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
-  int loopStart = currentChunk()->count;
+  int loopStart = currentChunk(parser)->count;
   // Condtion
   int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "expect `;` after loop condtion.");
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // pop loop Condtion value
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "expect `;` after loop condtion.");
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP); // pop loop Condtion value
   }
   // Increment clause
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int boodJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "expect `)` after for clauses.");
-    emitLoop(loopStart);
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int boodJump = emitJump(parser, OP_JUMP);
+    int incrementStart = currentChunk(parser)->count;
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "expect `)` after for clauses.");
+    emitLoop(parser, loopStart);
     loopStart = incrementStart;
-    patchJump(boodJump);
+    patchJump(parser, boodJump);
 
     // continue statement
     Continue *cur = (Continue *)malloc(sizeof(Continue));
     cur->patch_continue = incrementStart;
     cur->next = NULL;
-    if (c_head == NULL) {
-      c_head = cur;
+    if (parser->c_head == NULL) {
+      parser->c_head = cur;
     } else {
-      c_tail->next = cur;
+      parser->c_tail->next = cur;
     }
-    c_tail = cur;
+    parser->c_tail = cur;
   }
   // block statement
-  statement();
+  statement(parser);
 
-  emitLoop(loopStart);
+  emitLoop(parser, loopStart);
 
   // if have Condtion statement
   if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP); // if condtion is false, pop condtion value
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP); // if condtion is false, pop condtion value
   }
 
   // break patch
-  Break *temp = head;
+  Break *temp = parser->head;
   Break *last = NULL;
 
-  if (head != NULL) {
+  if (parser->head != NULL) {
     while (temp->next != NULL) {
       last = temp; // 倒数第二个节点
       temp = temp->next;
     }
 
     if (last == NULL) {
-      patchJump(temp->patch_break);
+      patchJump(parser, temp->patch_break);
     } else {
-      patchJump(last->next->patch_break);
-      tail = last;
+      patchJump(parser, last->next->patch_break);
+      parser->tail = last;
       last->next = NULL;
       free(temp);
     }
   }
-  endScope();
+  endScope(parser);
   
-  parser.is_for_while = false;
+  parser->is_for_while = false;
 }
 
 // 函数被绑定到一个变量中
-static void funDeclaration() {
-  uint8_t global = parseVariable("expect function name.");
-  markInitialized();
+static void funDeclaration(Parser *parser) {
+  uint32_t global = parseVariable(parser, "expect function name.");
+  markInitialized(parser);
   // function body
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-
-  beginScope();
-  consume(TOKEN_LEFT_PAREN, "expect `(` after function name.");
-  if (!check(TOKEN_RIGHT_PAREN)) {
+static void parameterList(Parser *parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "expect `(` after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("can't have more than 255 parameters.");
+      parser->compiler->function->arity++;
+      if (parser->compiler->function->arity > 255) {
+        errorAtCurrent(parser, "can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("expect parameter name.");
-      defineVariable(constant);
-    } while (match(TOKEN_COMMA));
+      uint32_t constant = parseVariable(parser, "expect parameter name.");
+      defineVariable(parser, constant);
+    } while (match(parser, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "expect `)` after function name.");
-  consume(TOKEN_LEFT_BRACE, "expect `{` after function name.");
-  block();
-  endScope();
+  consume(parser, TOKEN_RIGHT_PAREN, "expect `)` after function name.");
+  consume(parser, TOKEN_LEFT_BRACE, "expect `{` after function name.");
+}
 
-  ObjFunction *function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
-  for (int i = 0; i < function->upvalue_count; i++) {
-    emitByte(compiler.upvalues[i].is_local ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+// 预扫描里用到的名字如果是外层的局部变量或 upvalue, 就先捕获下来.
+// 函数体自己的局部变量同名时会多捕获一个, 不影响结果
+static void captureName(Parser *parser, Token name) {
+  if (resolveLocal(parser, parser->compiler, &name) != -1) {
+    return; // 参数
+  }
+  int count = parser->compiler->function->upvalue_count;
+  if (resolveUpValue(parser, parser->compiler, &name) != -1 &&
+      parser->compiler->function->upvalue_count > count) {
+    ValueArray *names = &parser->compiler->function->lazy->upvalue_names;
+    Value upvalue = OBJ_VAL(copyString(name.start, name.length));
+    push(upvalue); // GC
+    writeVlaueArray(names, upvalue);
+    pop();
   }
 }
 
-static Token syntheticToken(const char *text) {
-  Token token;
-  token.start = text;
-  token.length = (int)strlen(text);
-  return token;
+// 只匹配大括号, 不生成代码; 函数体第一次调用时由 compileLazy 编译
+static void skimFunctionBody(Parser *parser, FunctionType type) {
+  LazyBody *lazy = ALLOCATE(LazyBody, 1);
+  lazy->source = parser->current.start;
+  lazy->line = parser->current.line;
+  lazy->type = type;
+  lazy->in_class = parser->current_class != NULL;
+  lazy->has_super_class =
+      parser->current_class != NULL && parser->current_class->has_super_class;
+  initVlaueArray(&lazy->upvalue_names);
+  parser->compiler->function->lazy = lazy;
+
+  parameterList(parser);
+  int depth = 1;
+  while (depth > 0 && !check(parser, TOKEN_EOF)) {
+    switch (parser->current.type) {
+    case TOKEN_LEFT_BRACE:
+      depth += 1;
+      break;
+    case TOKEN_RIGHT_BRACE:
+      depth -= 1;
+      break;
+    case TOKEN_IDENTIFIER:
+      if (parser->previous.type != TOKEN_DOT) {
+        captureName(parser, parser->current);
+      }
+      break;
+    case TOKEN_SUPER:
+      captureName(parser, syntheticToken("super"));
+      captureName(parser, syntheticToken("this"));
+      break;
+    case TOKEN_THIS:
+      captureName(parser, syntheticToken("this"));
+      break;
+    default:
+      break;
+    }
+    advance(parser);
+  }
+  if (depth > 0) {
+    errorAtCurrent(parser, "expect `}` after block.");
+  }
 }
 
-static void classDeclaration() {
-  consume(TOKEN_IDENTIFIER, "expect class name.");
-  Token class_name = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
-  declareVariable();
+static void function(Parser *parser, FunctionType type) {
+  Compiler compiler;
+  initCompiler(parser, &compiler, type, NULL);
+
+  beginScope(parser);
+  ObjFunction *function;
+  if (vm.lazy_compile) {
+    skimFunctionBody(parser, type);
+    function = parser->compiler->function;
+    freeConstantSlots(parser->compiler);
+    parser->compiler = parser->compiler->enclosing;
+  } else {
+    parameterList(parser);
+    block(parser);
+    endScope(parser);
+    function = endCompiler(parser);
+  }
+  emitConstantOp(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
+  for (int i = 0; i < function->upvalue_count; i++) {
+    emitByte(parser, compiler.upvalues[i].is_local ? 1 : 0);
+    emitByte(parser, compiler.upvalues[i].index);
+  }
+}
+
+static void classDeclaration(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "expect class name.");
+  Token class_name = parser->previous;
+  uint32_t nameConstant = identifierConstant(parser, &parser->previous);
+  declareVariable(parser);
 
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(
+  emitConstantOp(parser, OP_CLASS, nameConstant);
+  defineVariable(parser, 
       nameConstant); // 在主体之前定义,用户就可以在类自己的方法主体中引用类本身
 
   ClassCompiler class_compiler;
-  class_compiler.enclosing = current_class;
+  class_compiler.enclosing = parser->current_class;
   class_compiler.has_super_class = false;
-  current_class = &class_compiler;
+  parser->current_class = &class_compiler;
 
   // extends SuperClassName
-  if (match(TOKEN_LESS)) {
-    consume(TOKEN_IDENTIFIER, "expect superclass name.");
-    variable(false); // super name
-    if (identifierEqual(&class_name, &parser.previous)) {
-      error("A class can't inherit from itself.");
+  if (match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "expect superclass name.");
+    variable(parser, false); // super name
+    if (identifierEqual(&class_name, &parser->previous)) {
+      error(parser, "A class can't inherit from itself.");
     }
 
-    beginScope();
-    addLocal(syntheticToken("super"));
-    defineVariable(0);
+    beginScope(parser);
+    addLocal(parser, syntheticToken("super"));
+    defineVariable(parser, 0);
 
-    namedVariable(class_name, false);
-    emitByte(OP_INHERIT);
+    namedVariable(parser, class_name, false);
+    emitByte(parser, OP_INHERIT);
     class_compiler.has_super_class = true;
   }
 
-  namedVariable(class_name, false); // op_get_global
-  consume(TOKEN_LEFT_BRACE, "expect `{` before class body.");
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    method();
+  namedVariable(parser, class_name, false); // op_get_global
+  consume(parser, TOKEN_LEFT_BRACE, "expect `{` before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
   }
-  consume(TOKEN_RIGHT_BRACE, "expect `}` after class body.");
-  emitByte(OP_POP);
+  consume(parser, TOKEN_RIGHT_BRACE, "expect `}` after class body.");
+  emitByte(parser, OP_POP);
 
   if (class_compiler.has_super_class) {
-    endScope();
+    endScope(parser);
   }
-  current_class = current_class->enclosing;
+  parser->current_class = parser->current_class->enclosing;
 }
 
-static void method() {
-  consume(TOKEN_IDENTIFIER, "expect method name.");
-  uint8_t constant_idx = identifierConstant(&parser.previous);
+static void method(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "expect method name.");
+  uint16_t selector = selectorIndex(parser, &parser->previous);
   // function body
   FunctionType type = TYPE_METHOD;
 
-  if (parser.previous.length == 4 &&
-      (memcmp(parser.previous.start, "init", 4) == 0)) {
+  if (parser->previous.length == 4 &&
+      (memcmp(parser->previous.start, "init", 4) == 0)) {
     type = TYPE_INITIALIZER;
   }
-  function(type);
-  emitBytes(OP_METHOD, constant_idx);
+  function(parser, type);
+  emitSelector(parser, OP_METHOD, selector);
 }
 
-static void this_(bool canAssign) {
-  if (current_class == NULL) {
-    error("can't use `this` outside of a class.");
+static void this_(Parser *parser, bool canAssign) {
+  if (parser->current_class == NULL) {
+    error(parser, "can't use `this` outside of a class.");
     return;
   }
-  variable(false);
+  variable(parser, false);
 }
 
-static void super_(bool canAssign) {
-  if (current_class == NULL) {
-    error("can't use `super` outsite of a class.");
+static void super_(Parser *parser, bool canAssign) {
+  if (parser->current_class == NULL) {
+    error(parser, "can't use `super` outsite of a class.");
   }
-  if (!current_class->has_super_class) {
-    error("can't use `super` in a class with no superclass.");
+  if (!parser->current_class->has_super_class) {
+    error(parser, "can't use `super` in a class with no superclass.");
   }
-  consume(TOKEN_DOT, "expect `.` after `super`.");
-  consume(TOKEN_IDENTIFIER, "expect supercalss method name.");
-  uint8_t name_idx = identifierConstant(&parser.previous);
-  namedVariable(syntheticToken("this"), false);
+  consume(parser, TOKEN_DOT, "expect `.` after `super`.");
+  consume(parser, TOKEN_IDENTIFIER, "expect supercalss method name.");
+  uint16_t name_idx = selectorIndex(parser, &parser->previous);
+  namedVariable(parser, syntheticToken("this"), false);
 
-  if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t args = argumentList();
-    namedVariable(syntheticToken("super"),
+  if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t args = argumentList(parser);
+    namedVariable(parser, syntheticToken("super"),
                   false); // bug: OP_GET_GLOBAL => OP_GET_UPVALUE
-    emitBytes(OP_SUPER_INVOKE, name_idx);
-    emitByte(args);
+    emitSelector(parser, OP_SUPER_INVOKE, name_idx);
+    emitByte(parser, args);
   } else {
-    namedVariable(syntheticToken("super"),
+    namedVariable(parser, syntheticToken("super"),
                   false); // bug: OP_GET_GLOBAL => OP_GET_UPVALUE
-    emitBytes(OP_GET_SUPER, name_idx);
+    emitSelector(parser, OP_GET_SUPER, name_idx);
   }
 }
 
-static void returnStatement() {
+static void returnStatement(Parser *parser) {
   // 在任何函数之外使用return都会报错
-  if (current->type == TYPE_SCRIPT) {
-    error("can't return from top-level code.");
+  if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "can't return from top-level code.");
   }
-  if (match(TOKEN_SEMICOLON)) {
-    emitReturn();
+  if (match(parser, TOKEN_SEMICOLON)) {
+    emitReturn(parser);
   } else {
-    if (current->type == TYPE_INITIALIZER) {
-      error("can't return a value an initizlizer function.");
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+      error(parser, "can't return a value an initizlizer function.");
     }
-    expression();
-    consume(TOKEN_SEMICOLON, "expect `;` after return value.");
-    emitByte(OP_RETURN);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "expect `;` after return value.");
+    emitByte(parser, OP_RETURN);
   }
 }
 
-static void breakStatement() {
-  consume(TOKEN_SEMICOLON, "expect `;` after break.");
-  if (parser.is_for_while) {
+// import "path"; 模块的顶层函数返回 nil, 丢掉
+static void importStatement(Parser *parser) {
+  consume(parser, TOKEN_STRING, "expect module path after import.");
+  uint32_t path = uniqueConstant(
+      parser, OBJ_VAL(copyString(parser->previous.start + 1,
+                                 parser->previous.length - 2)));
+  consume(parser, TOKEN_SEMICOLON, "expect `;` after module path.");
+  emitConstantOp(parser, OP_IMPORT, path);
+  emitByte(parser, OP_POP);
+}
+
+static void breakStatement(Parser *parser) {
+  consume(parser, TOKEN_SEMICOLON, "expect `;` after break.");
+  if (parser->is_for_while) {
     Break *cur = (Break *)malloc(sizeof(Break));
-    cur->patch_break = emitJump(OP_JUMP);
+    cur->patch_break = emitJump(parser, OP_JUMP);
     cur->next = NULL;
-    // emitByte(OP_POP);
-    if (head == NULL) {
-      head = cur;
+    // emitByte(parser, OP_POP);
+    if (parser->head == NULL) {
+      parser->head = cur;
     } else {
-      tail->next = cur;
+      parser->tail->next = cur;
     }
-    tail = cur;
+    parser->tail = cur;
   } else {
-    error("can't break top-level code, must in for or while statement.");
+    error(parser,
+          "can't break top-level code, must in for or while statement.");
   }
 }
 
-static void continueStatement() {
-  consume(TOKEN_SEMICOLON, "expect `;` after continue.");
-  if (parser.is_for_while) {
-    Continue *temp = c_head;
+static void continueStatement(Parser *parser) {
+  consume(parser, TOKEN_SEMICOLON, "expect `;` after continue.");
+  if (parser->is_for_while) {
+    Continue *temp = parser->c_head;
     Continue *last = NULL;
 
-    if (c_head != NULL) {
+    if (parser->c_head != NULL) {
       while (temp->next != NULL) {
         last = temp;
         temp = temp->next;
       }
 
       if (last == NULL) {
-        emitLoop(temp->patch_continue);
+        emitLoop(parser, temp->patch_continue);
       } else {
-        emitLoop(last->next->patch_continue);
-        c_tail = last;
+        emitLoop(parser, last->next->patch_continue);
+        parser->c_tail = last;
         last->next = NULL;
         free(temp);
       }
@@ -771,27 +984,20 @@ static void continueStatement() {
   }
 }
 
-static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  // printf("line %d ", parser.previous.line);
-  // if (value != 0) {
-  //   printf("literal is %f\n", value);
-  // }
-  Value v = {VAL_NUMBER};
-  v.as.number = value;
-  emitConstant(v);
+static void number(Parser *parser, bool canAssign) {
+  emitConstant(parser, NUMBER_VAL(parser->previous_number));
 }
 
-static void unary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
-  parsePrecedence(PREC_UNARY);
+static void unary(Parser *parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
+  parsePrecedence(parser, PREC_UNARY);
 
   switch (operatorType) {
   case TOKEN_MINUS:
-    emitByte(OP_NEGATE);
+    emitByte(parser, OP_NEGATE);
     break;
   case TOKEN_BANG:
-    emitByte(OP_NOT);
+    emitByte(parser, OP_NOT);
     break;
   default:
     return;
@@ -843,111 +1049,130 @@ ParseRule rules[] = {
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "expect ')' after expression");
+static void grouping(Parser *parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "expect ')' after expression");
+
+  // (obj.m)(args) 和 obj.m(args) 一样编译成 OP_INVOKE, 不创建 bound method
+  Chunk *chunk = currentChunk(parser);
+  int get = parser->property_get;
+  if (check(parser, TOKEN_LEFT_PAREN) && parser->last_rule == dot &&
+      get >= 0 && get + instructionLength(chunk, get) == chunk->count) {
+    uint32_t name_idx = chunk->code[get] == OP_GET_PROPERTY_LONG
+                            ? readLongOperand(chunk->code + get + 1)
+                            : chunk->code[get + 1];
+    ObjString *name = AS_STRING(chunk->constants.values[name_idx]);
+    chunk->count = get;
+    parser->property_get = -1;
+    advance(parser);
+    uint16_t selector = methodSelector(name);
+    uint8_t argCount = argumentList(parser);
+    emitSelector(parser, OP_INVOKE, selector);
+    emitByte(parser, argCount);
+  }
 }
 
-static void binary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void binary(Parser *parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
   ParseRule *rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
   switch (operatorType) {
   case TOKEN_PLUS:
-    emitByte(OP_ADD);
+    emitByte(parser, OP_ADD);
     break;
   case TOKEN_MINUS:
-    emitByte(OP_SUBTRACT);
+    emitByte(parser, OP_SUBTRACT);
     break;
   case TOKEN_STAR:
-    emitByte(OP_MULTIPLY);
+    emitByte(parser, OP_MULTIPLY);
     break;
   case TOKEN_SLASH:
-    emitByte(OP_DIVIDE);
+    emitByte(parser, OP_DIVIDE);
     break;
   case TOKEN_BANG_EQUAL:
-    emitBytes(OP_EQUAL, OP_NOT);
+    emitBytes(parser, OP_EQUAL, OP_NOT);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emitByte(OP_EQUAL);
+    emitByte(parser, OP_EQUAL);
     break;
   case TOKEN_LESS:
-    emitByte(OP_LESS);
+    emitByte(parser, OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    emitBytes(OP_GREATER, OP_NOT);
+    emitBytes(parser, OP_GREATER, OP_NOT);
     break;
   case TOKEN_GREATER:
-    emitByte(OP_GREATER);
+    emitByte(parser, OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitBytes(OP_LESS, OP_NOT);
+    emitBytes(parser, OP_LESS, OP_NOT);
     break;
   default:
     return;
   }
 }
 
-static void literal(bool canAssign) {
-  switch (parser.previous.type) {
+static void literal(Parser *parser, bool canAssign) {
+  switch (parser->previous.type) {
   case TOKEN_TRUE:
-    emitByte(OP_TRUE);
+    emitByte(parser, OP_TRUE);
     break;
   case TOKEN_FALSE:
-    emitByte(OP_FALSE);
+    emitByte(parser, OP_FALSE);
     break;
   case TOKEN_NIL:
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
     break;
   default:
     return;
   }
 }
 
-static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(
-      copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser *parser, bool canAssign) {
+  emitConstant(parser, OBJ_VAL(
+      copyString(parser->previous.start + 1, parser->previous.length - 2)));
 }
 
 // identifier parse
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser *parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser *parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  int arg = resolveLocal(parser, parser->compiler, &name);
 
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
   } else {
-    arg = resolveUpValue(current, &name);
+    arg = resolveUpValue(parser, parser->compiler, &name);
     if ((arg != -1)) {
       getOp = OP_GET_UPVALUE;
       setOp = OP_SET_UPVALUE;
     } else {
-      arg = identifierConstant(&name);
+      arg = identifierConstant(parser, &name);
       getOp = OP_GET_GLOBAL;
       setOp = OP_SET_GLOBAL;
     }
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+  // 局部变量和 upvalue 的下标小于 256, 只有全局变量会用到 _LONG
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitConstantOp(parser, setOp, (uint32_t)arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitConstantOp(parser, getOp, (uint32_t)arg);
   }
 }
 
-static int resolveLocal(Compiler *compiler, Token *name) {
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local *local = &compiler->locals[i];
     if (identifierEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -956,7 +1181,8 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static int addUpValue(Compiler *compiler, uint8_t local_idx, bool is_local) {
+static int addUpValue(Parser *parser, Compiler *compiler, uint8_t local_idx,
+                      bool is_local) {
   int upvalue_count = compiler->function->upvalue_count;
 
   for (int i = 0; i < upvalue_count; i++) {
@@ -967,7 +1193,7 @@ static int addUpValue(Compiler *compiler, uint8_t local_idx, bool is_local) {
   }
 
   if (upvalue_count == UINT8_COUNT) {
-    error("too many closure variable in function.");
+    error(parser, "too many closure variable in function.");
     return 0;
   }
   // printf("up index==> %d\n", local_idx);
@@ -977,113 +1203,209 @@ static int addUpValue(Compiler *compiler, uint8_t local_idx, bool is_local) {
   return upvalue_count;
 }
 
-static int resolveUpValue(Compiler *compiler, Token *name) {
-  if (compiler->enclosing == NULL) {
+// 惰性编译的函数没有外层 compiler, 按预扫描记下的名字找 upvalue
+static int resolveLazyUpValue(Compiler *compiler, Token *name) {
+  LazyBody *lazy = compiler->function->lazy;
+  if (lazy == NULL) {
     return -1;
   }
+  for (uint32_t i = 0; i < lazy->upvalue_names.count; i++) {
+    ObjString *upvalue = AS_STRING(lazy->upvalue_names.values[i]);
+    if (upvalue->length == name->length &&
+        memcmp(upvalue->chars, name->start, name->length) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
 
-  int local_idx = resolveLocal(compiler->enclosing, name);
+static int resolveUpValue(Parser *parser, Compiler *compiler, Token *name) {
+  if (compiler->enclosing == NULL) {
+    return resolveLazyUpValue(compiler, name);
+  }
+
+  int local_idx = resolveLocal(parser, compiler->enclosing, name);
 
   if (local_idx != -1) {
     compiler->enclosing->locals[local_idx].is_captured = true;
     // printf("outer local idx: %d\n",local_idx);
-    return addUpValue(compiler, (uint8_t)local_idx, true);
+    return addUpValue(parser, compiler, (uint8_t)local_idx, true);
   }
 
-  int upvalue = resolveUpValue(compiler->enclosing, name);
+  int upvalue = resolveUpValue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpValue(compiler, (uint8_t)upvalue, false);
+    return addUpValue(parser, compiler, (uint8_t)upvalue, false);
   }
 
   return -1;
 }
 
-static void and_(bool canAssign) {
+static void and_(Parser *parser, bool canAssign) {
   // 如果左边值为假则留在栈顶，跳过右值
   // 如果左边值为真则弹出栈顶，计算右值留在栈顶
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
-  patchJump(endJump);
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
+  patchJump(parser, endJump);
 }
 
-static void or_(bool canAssign) {
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
-  patchJump(elseJump);
+static void or_(Parser *parser, bool canAssign) {
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
+  patchJump(parser, elseJump);
   // right value
-  emitByte(OP_POP);
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
-}
-
-static void dot(bool canAssign) {
-  consume(TOKEN_IDENTIFIER, "expect property name after `.`.");
-  uint8_t nameCanstant = identifierConstant(&parser.previous);
-
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(OP_SET_PROPERTY, nameCanstant);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, nameCanstant);
-    emitByte(argCount);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_OR);
+  patchJump(parser, endJump);
+}
+
+static void dot(Parser *parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "expect property name after `.`.");
+  Token name = parser->previous;
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    uint32_t nameCanstant = identifierConstant(parser, &name);
+    expression(parser);
+    emitConstantOp(parser, OP_SET_PROPERTY, nameCanstant);
+    parser->property_get = -1;
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint16_t selector = selectorIndex(parser, &name);
+    uint8_t argCount = argumentList(parser);
+    emitSelector(parser, OP_INVOKE, selector);
+    emitByte(parser, argCount);
+    parser->property_get = -1;
   } else {
-    emitBytes(OP_GET_PROPERTY, nameCanstant);
+    uint32_t nameCanstant = identifierConstant(parser, &name);
+    parser->property_get = currentChunk(parser)->count;
+    emitConstantOp(parser, OP_GET_PROPERTY, nameCanstant);
   }
 }
 
 // foo(1,2);
-static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+static void call(Parser *parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);
 }
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser *parser) {
   uint8_t argCount = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      expression();
+      expression(parser);
       if (argCount == 255) {
-        error("can't have more than 255 arguments.");
+        error(parser, "can't have more than 255 arguments.");
       }
       argCount += 1;
-    } while (match(TOKEN_COMMA));
+    } while (match(parser, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "expect `)` after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "expect `)` after arguments.");
   return argCount;
 }
 
 void markCompilerRoots() {
-  Compiler *compiler = current;
   // printf("====compiler start====\n");
-  while (compiler != NULL) {
-    markObject((Obj *)compiler->function);
-    compiler = compiler->enclosing;
+  for (Parser *parser = vm.parsers; parser != NULL;
+       parser = parser->enclosing) {
+    Compiler *compiler = parser->compiler;
+    while (compiler != NULL) {
+      markObject((Obj *)compiler->function);
+      compiler = compiler->enclosing;
+    }
   }
   // printf("====compiler end====\n");
 }
 
-ObjFunction *compiler(const char *source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
-  parser.hadError = false;
-  parser.panicMode = false;
+#ifdef GC_COMPACT
+void relocateCompilerRoots() {
+  for (Parser *parser = vm.parsers; parser != NULL;
+       parser = parser->enclosing) {
+    for (Compiler *compiler = parser->compiler; compiler != NULL;
+         compiler = compiler->enclosing) {
+      compiler->function =
+          (ObjFunction *)forwardObject((Obj *)compiler->function);
+    }
+  }
+}
+#endif
 
-  advance();
-  while (!match(TOKEN_EOF)) {
-    declaration();
-    parser.is_for_while = false;
+// 下一次编译 (惰性函数体, REPL 的下一行) 从空链表开始
+static void resetLoopPatches(Parser *parser) {
+  if (parser->head != NULL) {
+    parser->tail = NULL;
+    free(parser->head);
+    parser->head = NULL;
   }
-  ObjFunction *function = endCompiler();
-  if (head != NULL) {
-    tail = NULL;
-    free(head);
+  if (parser->c_head != NULL) {
+    parser->c_tail = NULL;
+    free(parser->c_head);
+    parser->c_head = NULL;
   }
-  if (c_head != NULL) {
-    c_tail = NULL;
-    free(c_head);
+}
+
+// 每次编译一份 Parser, 登记到 vm.parsers 让 GC 能找到编译中的函数
+static void initParser(Parser *parser, const char *source, int line) {
+  initScannerAt(&parser->scanner, source, line);
+  parser->is_for_while = false;
+  parser->hadError = false;
+  parser->panicMode = false;
+  parser->last_rule = NULL;
+  parser->property_get = -1;
+  parser->compiler = NULL;
+  parser->current_class = NULL;
+  parser->head = NULL;
+  parser->tail = NULL;
+  parser->c_head = NULL;
+  parser->c_tail = NULL;
+  parser->enclosing = vm.parsers;
+  vm.parsers = parser;
+}
+
+static void finishParser(Parser *parser) {
+  resetLoopPatches(parser);
+  vm.parsers = parser->enclosing;
+}
+
+ObjFunction *compiler(const char *source) {
+  Parser context;
+  Parser *parser = &context;
+  initParser(parser, source, 1);
+  Compiler compiler;
+  initCompiler(parser, &compiler, TYPE_SCRIPT, NULL);
+
+  advance(parser);
+  while (!match(parser, TOKEN_EOF)) {
+    declaration(parser);
+    parser->is_for_while = false;
   }
-  return parser.hadError ? NULL : function;
+  ObjFunction *function = endCompiler(parser);
+  finishParser(parser);
+  return parser->hadError ? NULL : function;
+}
+
+// 第一次调用时编译预扫描过的函数体, 生成的代码写进原来的 ObjFunction
+bool compileLazy(ObjFunction *function) {
+  LazyBody *lazy = function->lazy;
+  Parser context;
+  Parser *parser = &context;
+  initParser(parser, lazy->source, lazy->line);
+  ClassCompiler class_compiler;
+  class_compiler.enclosing = NULL;
+  class_compiler.has_super_class = lazy->has_super_class;
+  parser->current_class = lazy->in_class ? &class_compiler : NULL;
+  Compiler compiler;
+  initCompiler(parser, &compiler, (FunctionType)lazy->type, function);
+
+  advance(parser);
+  beginScope(parser);
+  function->arity = 0;
+  parameterList(parser);
+  block(parser);
+  endScope(parser);
+  endCompiler(parser);
+  finishParser(parser);
+
+  function->lazy = NULL;
+  freeVlaueArray(&lazy->upvalue_names);
+  FREE(LazyBody, lazy);
+  return !parser->hadError;
 }
@@ -19,7 +19,8 @@ typedef enum {
   PREC_PRIMARY     // a.b | arr[0]
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef struct Parser Parser;
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -46,6 +47,15 @@ typedef struct {
   int index;
 } UpValue;
 
+// 常量去重: 数字的位模式或字符串指针 -> 常量池下标, 开放寻址
+typedef struct {
+  uint64_t bits;
+  uint32_t index; // CONSTANT_SLOT_EMPTY 表示空槽
+  uint8_t type;   // ValueType, 数字和指针的位模式可能相同
+} ConstantSlot;
+
+#define CONSTANT_SLOT_EMPTY UINT32_MAX
+
 typedef struct Compiler {
   struct Compiler *enclosing;
   Local locals[UINT8_COUNT];
@@ -55,6 +65,9 @@ typedef struct Compiler {
   ObjFunction *function;
   FunctionType type;
   UpValue upvalues[UINT8_COUNT];
+  ConstantSlot *constants;
+  int constant_count;
+  int constant_capacity;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -72,58 +85,94 @@ typedef struct Continue {
   struct Continue *next;
 } Continue;
 
+// 一次编译的全部状态, 编译之间互不共享
+struct Parser {
+  Scanner scanner;
+  Token current;
+  Token previous;
+  double previous_number; // previous 是数字时的值
+  bool is_for_while;
+  bool hadError;
+  bool panicMode;
+  // 外层 parsePrecedence 最后执行的规则, grouping 用来识别 (obj.m)(...)
+  ParseFn last_rule;
+  int property_get; // 最近一条 OP_GET_PROPERTY(_LONG) 的位置
+  Compiler *compiler; // 正在编译的函数
+  ClassCompiler *current_class;
+  Break *head, *tail;
+  Continue *c_head, *c_tail;
+  Parser *enclosing; // vm.parsers 链表, GC 从这里找编译中的函数
+};
+
 ObjFunction *compiler(const char *source);
-static void initCompiler(Compiler *compiler, FunctionType type);
-static void error(const char *message);
-// static void parsePrecedence(Precedence precedence);
-static void advance();
-static void binary(bool canAssign);
-static void grouping(bool canAssign);
+bool compileLazy(ObjFunction *function);
+static void initCompiler(Parser *parser, Compiler *compiler,
+                         FunctionType type, ObjFunction *function);
+static void error(Parser *parser, const char *message);
+// static void parsePrecedence(Parser *parser, Precedence precedence);
+static void advance(Parser *parser);
+static void binary(Parser *parser, bool canAssign);
+static void grouping(Parser *parser, bool canAssign);
 static ParseRule *getRule(TokenType type);
-static void literal(bool canAssign);
-static void string(bool canAssign);
-static void variable(bool canAssign);
-static void call(bool canAssign);
-static uint8_t argumentList();
-static void declaration();
-static void statement();
-static bool match(TokenType type);
-static bool check(TokenType type);
-static void printStatement();
-static void expressionStatement();
-static void synchronize();
-static void varDeclaration();
-static uint8_t parseVariable(const char *msg);
-static void defineVariable(uint8_t global);
-static uint8_t identifierConstant(Token *token);
-static void block();
-static void beginScope();
-static void endScope();
-static void declareVariable();
-static void addLocal(Token name);
+static void literal(Parser *parser, bool canAssign);
+static void string(Parser *parser, bool canAssign);
+static void variable(Parser *parser, bool canAssign);
+static void call(Parser *parser, bool canAssign);
+static uint8_t argumentList(Parser *parser);
+static void declaration(Parser *parser);
+static void statement(Parser *parser);
+static bool match(Parser *parser, TokenType type);
+static bool check(Parser *parser, TokenType type);
+static void printStatement(Parser *parser);
+static void expressionStatement(Parser *parser);
+static void synchronize(Parser *parser);
+static void varDeclaration(Parser *parser);
+static uint32_t parseVariable(Parser *parser, const char *msg);
+static void defineVariable(Parser *parser, uint32_t global);
+static uint32_t identifierConstant(Parser *parser, Token *token);
+static uint32_t uniqueConstant(Parser *parser, Value value);
+static void freeConstantSlots(Compiler *compiler);
+static void emitConstantOp(Parser *parser, uint8_t op, uint32_t index);
+static uint16_t selectorIndex(Parser *parser, Token *token);
+static void emitSelector(Parser *parser, uint8_t op, uint16_t selector);
+static void block(Parser *parser);
+static void beginScope(Parser *parser);
+static void endScope(Parser *parser);
+static void declareVariable(Parser *parser);
+static void addLocal(Parser *parser, Token name);
 static bool identifierEqual(Token *a, Token *b);
-static int resolveLocal(Compiler *compiler, Token *name);
-static void markInitialized();
-static void ifStatement();
-static int emitJump(uint8_t instruction);
-static void patchJump(int offset);
-static void and_(bool canAssign);
-static void or_(bool canAssign);
-static void dot(bool canAssign);
-static void whileStatement();
-static void emitLoop(int loopStart);
-static void forStatement();
-static void funDeclaration();
-static void function(FunctionType type);
-static void returnStatement();
-static void breakStatement();
-static void continueStatement();
-static void classDeclaration();
-static void method();
-static void this_(bool canAssign);
-static void super_(bool canAssign);
-static void namedVariable(Token name, bool canAssign);
-static int addUpValue(Compiler *compiler, uint8_t local_idx, bool is_local);
-static int resolveUpValue(Compiler *compiler, Token *name);
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name);
+static void markInitialized(Parser *parser);
+static void ifStatement(Parser *parser);
+static int emitJump(Parser *parser, uint8_t instruction);
+static void patchJump(Parser *parser, int offset);
+static void and_(Parser *parser, bool canAssign);
+static void or_(Parser *parser, bool canAssign);
+static void dot(Parser *parser, bool canAssign);
+static void whileStatement(Parser *parser);
+static void emitLoop(Parser *parser, int loopStart);
+static void forStatement(Parser *parser);
+static void funDeclaration(Parser *parser);
+static void function(Parser *parser, FunctionType type);
+static void parameterList(Parser *parser);
+static void skimFunctionBody(Parser *parser, FunctionType type);
+static void captureName(Parser *parser, Token name);
+static void returnStatement(Parser *parser);
+static void breakStatement(Parser *parser);
+static void continueStatement(Parser *parser);
+static void importStatement(Parser *parser);
+static void resetLoopPatches(Parser *parser);
+static void initParser(Parser *parser, const char *source, int line);
+static void finishParser(Parser *parser);
+static void classDeclaration(Parser *parser);
+static void method(Parser *parser);
+static void this_(Parser *parser, bool canAssign);
+static void super_(Parser *parser, bool canAssign);
+static void namedVariable(Parser *parser, Token name, bool canAssign);
+static int addUpValue(Parser *parser, Compiler *compiler, uint8_t local_idx,
+                      bool is_local);
+static int resolveUpValue(Parser *parser, Compiler *compiler, Token *name);
+static int resolveLazyUpValue(Compiler *compiler, Token *name);
 void markCompilerRoots();
+void relocateCompilerRoots();
 #endif
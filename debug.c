@@ -2,6 +2,7 @@
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,25 +19,62 @@ static uint32_t simpleInstruction(const char *name, uint32_t offset) {
   return offset + 1;
 }
 
+// 返回常量下标, *offset 移到操作数之后
+static uint32_t constantOperand(Chunk *chunk, uint32_t *offset) {
+  uint8_t *code = chunk->code + *offset;
+  if (code[0] >= OP_CONSTANT_LONG) {
+    *offset += 4;
+    return readLongOperand(code + 1);
+  }
+  *offset += 2;
+  return code[1];
+}
+
 static uint32_t constantInstruction(const char *name, Chunk *chunk,
                                     uint32_t offset) {
-  uint8_t constant_idx = chunk->code[offset + 1];
+  uint32_t next = offset;
+  uint32_t constant_idx = constantOperand(chunk, &next);
   printf("opcode:%-16s opcode_index:%1d constant_index:%1d \"", name, offset,
          constant_idx);
   printValue(chunk->constants.values[constant_idx]);
   printf("\"\n");
-  return offset + 2; // 下一条指令起始位置的偏移量
+  return next; // 下一条指令起始位置的偏移量
+}
+
+static uint32_t closureInstruction(const char *name, Chunk *chunk,
+                                   uint32_t offset) {
+  uint32_t i = offset;
+  uint32_t constant_idx = constantOperand(chunk, &i);
+  printf("opcode:%-16s constant_idx:%1d ", name, constant_idx);
+  printValue(chunk->constants.values[constant_idx]);
+  printf("\n");
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant_idx]);
+  for (int j = 0; j < function->upvalue_count; j++) {
+    int is_local = chunk->code[i++];
+    int idx = chunk->code[i++];
+    printf("%04d  |       %s %d\n", offset - 2,
+           is_local ? "local" : "upvalue", idx);
+  }
+  return i;
+}
+
+static uint32_t selectorInstruction(const char *name, Chunk *chunk,
+                                    uint32_t offset) {
+  uint16_t selector = (uint16_t)(chunk->code[offset + 1] << 8);
+  selector |= chunk->code[offset + 2];
+  printf("opcode:%-16s opcode_index:%1d selector:%1d \"%s\"\n", name, offset,
+         selector, SELECTOR_NAME(selector)->chars);
+  return offset + 3;
 }
 
 static uint32_t invokeInstruction(const char *name, Chunk *chunk,
                                   uint32_t offset) {
-  uint8_t constant_idx = chunk->code[offset + 1];
-  uint8_t arg_count = chunk->code[offset + 2];
-  printf("opcode:%-16s (%d args) constant_idx:%4d `", name, arg_count,
-         constant_idx);
-  printValue(chunk->constants.values[constant_idx]);
-  printf("`\n");
-  return offset + 3; // 下一条指令起始位置的偏移量
+  uint16_t selector = (uint16_t)(chunk->code[offset + 1] << 8);
+  selector |= chunk->code[offset + 2];
+  uint8_t arg_count = chunk->code[offset + 3];
+  printf("opcode:%-16s (%d args) selector:%4d `%s`\n", name, arg_count,
+         selector, SELECTOR_NAME(selector)->chars);
+  return offset + 4; // 下一条指令起始位置的偏移量
 }
 
 static uint32_t localInstruction(const char *name, Chunk *chunk,
@@ -123,22 +161,9 @@ uint32_t disassembleInstruction(Chunk *chunk, uint32_t offset) {
   case OP_LOOP:
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
   case OP_CALL:
-    return simpleInstruction("OP_CALL", offset);
+    return byteInstruction("OP_CALL", chunk, offset);
   case OP_CLOSURE:
-    int i = offset;
-    uint8_t constant_idx = chunk->code[i + 1];
-    printf("opcode:%-16s constant_idx:%1d ", "OP_CLOSURE", constant_idx);
-    printValue(chunk->constants.values[constant_idx]);
-    printf("\n");
-    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant_idx]);
-    i += 2;
-    for (int j = 0; j < function->upvalue_count; j++) {
-      int is_local = chunk->code[i++];
-      int idx = chunk->code[i++];
-      printf("%04d  |       %s %d\n", offset - 2,
-             is_local ? "local" : "upvalue", idx);
-    }
-    return offset + i;
+    return closureInstruction("OP_CLOSURE", chunk, offset);
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_GET_UPVALUE:
@@ -152,15 +177,35 @@ uint32_t disassembleInstruction(Chunk *chunk, uint32_t offset) {
   case OP_GET_PROPERTY:
     return constantInstruction("OP_GET_PROPERTY", chunk, offset);
   case OP_METHOD:
-    return constantInstruction("OP_METHOD", chunk, offset);
+    return selectorInstruction("OP_METHOD", chunk, offset);
   case OP_INVOKE:
     return invokeInstruction("OP_INVOKE", chunk, offset);
   case OP_INHERIT:
     return simpleInstruction("OP_INHERIT", offset);
   case OP_GET_SUPER:
-    return constantInstruction("OP_GET_SUPER", chunk, offset);
+    return selectorInstruction("OP_GET_SUPER", chunk, offset);
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_IMPORT:
+    return constantInstruction("OP_IMPORT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantInstruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return constantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return constantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+  case OP_SET_GLOBAL_LONG:
+    return constantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+  case OP_CLOSURE_LONG:
+    return closureInstruction("OP_CLOSURE_LONG", chunk, offset);
+  case OP_CLASS_LONG:
+    return constantInstruction("OP_CLASS_LONG", chunk, offset);
+  case OP_SET_PROPERTY_LONG:
+    return constantInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+  case OP_GET_PROPERTY_LONG:
+    return constantInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+  case OP_IMPORT_LONG:
+    return constantInstruction("OP_IMPORT_LONG", chunk, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
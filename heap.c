@@ -0,0 +1,510 @@
+#include "heap.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t classSizes[HEAP_CLASS_COUNT] = {
+    16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+};
+
+// (size + 7) / 8 -> size class
+static uint8_t sizeToClass[HEAP_MAX_SMALL / 8 + 1];
+
+#define PAGE_HEADER_SIZE ((sizeof(HeapPage) + 15) & ~(size_t)15)
+
+// ASan 看不到 slot 的回收, 手动标记, 让 GC 漏标的对象在下次访问时报错
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POISON_SLOT(slot, size)                                                \
+  ASAN_POISON_MEMORY_REGION((uint8_t *)(slot) + sizeof(HeapSlot),             \
+                            (size) - sizeof(HeapSlot))
+#define UNPOISON_SLOT(slot, size) ASAN_UNPOISON_MEMORY_REGION(slot, size)
+#else
+#define POISON_SLOT(slot, size) ((void)(slot), (void)(size))
+#define UNPOISON_SLOT(slot, size) ((void)(slot), (void)(size))
+#endif
+
+void initHeap(Heap *heap) {
+  // 只在第一个 VM 里填表, 之后别的线程的 VM 只读它
+  if (sizeToClass[HEAP_MAX_SMALL / 8] == 0) {
+    int cls = 0;
+    for (int i = 0; i <= HEAP_MAX_SMALL / 8; i++) {
+      while (classSizes[cls] < (uint32_t)i * 8) {
+        cls += 1;
+      }
+      sizeToClass[i] = (uint8_t)cls;
+    }
+  }
+
+  for (int kind = HEAP_OBJECT; kind <= HEAP_RAW; kind++) {
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+      heap->classes[kind][i].pages = NULL;
+      heap->classes[kind][i].partial = NULL;
+      heap->classes[kind][i].page_count = 0;
+    }
+  }
+  heap->large = NULL;
+  heap->page_bytes = 0;
+  heap->large_bytes = 0;
+}
+
+int heapSizeClass(size_t size) {
+  if (size > HEAP_MAX_SMALL) {
+    return HEAP_LARGE_CLASS;
+  }
+  return sizeToClass[(size + 7) >> 3];
+}
+
+static HeapPage *allocatePage(size_t size) {
+  HeapPage *page = (HeapPage *)aligned_alloc(HEAP_PAGE_SIZE, size);
+  if (page == NULL) {
+    exit(1);
+  }
+  return page;
+}
+
+static void initPageSlots(HeapPage *page, uint32_t slot_size) {
+  page->slots = (uint8_t *)page + PAGE_HEADER_SIZE;
+  page->slot_size = slot_size;
+  page->slot_recip =
+      (uint32_t)((((uint64_t)1 << 32) + slot_size - 1) / slot_size);
+  memset(page->marks, 0, sizeof(page->marks));
+  memset(page->allocated, 0, sizeof(page->allocated));
+}
+
+static void linkPartial(HeapClass *cls, HeapPage *page) {
+  page->in_partial = true;
+  page->prev_partial = NULL;
+  page->next_partial = cls->partial;
+  if (cls->partial != NULL) {
+    cls->partial->prev_partial = page;
+  }
+  cls->partial = page;
+}
+
+static void unlinkPartial(HeapClass *cls, HeapPage *page) {
+  if (!page->in_partial) {
+    return;
+  }
+  page->in_partial = false;
+  if (page->prev_partial != NULL) {
+    page->prev_partial->next_partial = page->next_partial;
+  } else {
+    cls->partial = page->next_partial;
+  }
+  if (page->next_partial != NULL) {
+    page->next_partial->prev_partial = page->prev_partial;
+  }
+  page->prev_partial = NULL;
+  page->next_partial = NULL;
+}
+
+static void linkPage(HeapPage **list, HeapPage *page) {
+  page->prev = NULL;
+  page->next = *list;
+  if (*list != NULL) {
+    (*list)->prev = page;
+  }
+  *list = page;
+}
+
+static void unlinkPage(HeapPage **list, HeapPage *page) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    *list = page->next;
+  }
+  if (page->next != NULL) {
+    page->next->prev = page->prev;
+  }
+}
+
+static HeapPage *newPage(Heap *heap, HeapKind kind, int size_class) {
+  HeapClass *cls = &heap->classes[kind][size_class];
+  HeapPage *page = allocatePage(HEAP_PAGE_SIZE);
+  page->free_list = NULL;
+  initPageSlots(page, classSizes[size_class]);
+  page->slot_count = (HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / page->slot_size;
+  page->bump = 0;
+  page->live_count = 0;
+  page->kind = (uint8_t)kind;
+  page->size_class = (uint8_t)size_class;
+  page->in_partial = false;
+  page->evacuating = false;
+
+  linkPage(&cls->pages, page);
+  linkPartial(cls, page);
+  cls->page_count += 1;
+  heap->page_bytes += HEAP_PAGE_SIZE;
+  return page;
+}
+
+static void releasePage(Heap *heap, HeapPage *page) {
+  HeapClass *cls = &heap->classes[page->kind][page->size_class];
+  unlinkPartial(cls, page);
+  unlinkPage(&cls->pages, page);
+  cls->page_count -= 1;
+  heap->page_bytes -= HEAP_PAGE_SIZE;
+  UNPOISON_SLOT(page, HEAP_PAGE_SIZE);
+  free(page);
+}
+
+static void *allocateLarge(Heap *heap, size_t size) {
+  HeapLarge *large = (HeapLarge *)malloc(sizeof(HeapLarge) + size);
+  if (large == NULL) {
+    exit(1);
+  }
+  large->prev = NULL;
+  large->next = heap->large;
+  if (heap->large != NULL) {
+    heap->large->prev = large;
+  }
+  heap->large = large;
+  large->size = size;
+  large->marked = 0;
+  heap->large_bytes += size;
+  return large + 1;
+}
+
+static void freeLarge(Heap *heap, HeapLarge *large) {
+  if (large->prev != NULL) {
+    large->prev->next = large->next;
+  } else {
+    heap->large = large->next;
+  }
+  if (large->next != NULL) {
+    large->next->prev = large->prev;
+  }
+  heap->large_bytes -= large->size;
+  free(large);
+}
+
+void *heapAllocate(Heap *heap, HeapKind kind, size_t size) {
+  int size_class = heapSizeClass(size);
+  if (size_class == HEAP_LARGE_CLASS) {
+    if (kind == HEAP_OBJECT) {
+      return allocateLarge(heap, size);
+    }
+    void *result = malloc(size);
+    if (result == NULL) {
+      exit(1);
+    }
+    return result;
+  }
+
+  HeapClass *cls = &heap->classes[kind][size_class];
+  HeapPage *page = cls->partial;
+  if (page == NULL) {
+    page = newPage(heap, kind, size_class);
+  }
+
+  void *slot;
+  if (page->free_list != NULL) {
+    slot = page->free_list;
+    page->free_list = page->free_list->next;
+  } else {
+    slot = page->slots + (size_t)page->bump * page->slot_size;
+    page->bump += 1;
+  }
+  UNPOISON_SLOT(slot, page->slot_size);
+  page->live_count += 1;
+  if (kind == HEAP_OBJECT) {
+    uint32_t idx = heapSlotIndex(page, slot);
+    page->allocated[idx >> 6] |= (uint64_t)1 << (idx & 63);
+  }
+
+  if (page->free_list == NULL && page->bump == page->slot_count) {
+    unlinkPartial(cls, page);
+  }
+  return slot;
+}
+
+void heapFree(Heap *heap, HeapKind kind, void *pointer, size_t size) {
+  if (pointer == NULL) {
+    return;
+  }
+  if (size > HEAP_MAX_SMALL) {
+    if (kind == HEAP_OBJECT) {
+      freeLarge(heap, HEAP_LARGE_OF(pointer));
+    } else {
+      free(pointer);
+    }
+    return;
+  }
+
+  HeapPage *page = HEAP_PAGE_OF(pointer);
+  HeapClass *cls = &heap->classes[page->kind][page->size_class];
+  bool was_full = page->free_list == NULL && page->bump == page->slot_count;
+
+  if (page->kind == HEAP_OBJECT) {
+    uint32_t idx = heapSlotIndex(page, pointer);
+    page->allocated[idx >> 6] &= ~((uint64_t)1 << (idx & 63));
+  }
+
+  HeapSlot *slot = (HeapSlot *)pointer;
+  slot->next = page->free_list;
+  page->free_list = slot;
+  POISON_SLOT(slot, page->slot_size);
+  page->live_count -= 1;
+
+  if (page->evacuating) {
+    if (page->live_count == 0) {
+      releasePage(heap, page);
+    }
+    return;
+  }
+
+  if (was_full) {
+    linkPartial(cls, page);
+  }
+
+  if (page->live_count == 0) {
+    // 只剩这一页有空位时留作备用, 否则归还
+    if (cls->partial == page && page->next_partial == NULL) {
+      page->free_list = NULL;
+      page->bump = 0;
+    } else {
+      releasePage(heap, page);
+    }
+  }
+}
+
+void heapClearMarks(Heap *heap) {
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    for (HeapPage *page = heap->classes[HEAP_OBJECT][i].pages; page != NULL;
+         page = page->next) {
+      memset(page->marks, 0, sizeof(page->marks));
+    }
+  }
+  for (HeapLarge *large = heap->large; large != NULL; large = large->next) {
+    large->marked = 0;
+  }
+}
+
+// 释放 page 中所有 allocated 但未 marked 的 slot
+static void sweepPage(HeapPage *page, void (*release)(void *object)) {
+  for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+    uint64_t dead = page->allocated[i] & ~page->marks[i];
+    while (dead != 0) {
+      int bit = __builtin_ctzll(dead);
+      dead &= dead - 1;
+      bool last = page->live_count == 1;
+      release(page->slots + (size_t)(i * 64 + bit) * page->slot_size);
+      if (last) {
+        return; // page 可能已经归还
+      }
+    }
+  }
+}
+
+void heapSweep(Heap *heap, void (*release)(void *object)) {
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    HeapPage *page = heap->classes[HEAP_OBJECT][i].pages;
+    while (page != NULL) {
+      HeapPage *next = page->next;
+      sweepPage(page, release);
+      page = next;
+    }
+  }
+  HeapLarge *large = heap->large;
+  while (large != NULL) {
+    HeapLarge *next = large->next;
+    if (!large->marked) {
+      release(large + 1);
+    }
+    large = next;
+  }
+}
+
+// 空闲 slot 占 slab 容量的比例
+double heapFragmentation(Heap *heap) {
+  size_t capacity = 0;
+  size_t used = 0;
+  for (int kind = HEAP_OBJECT; kind <= HEAP_RAW; kind++) {
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+      for (HeapPage *page = heap->classes[kind][i].pages; page != NULL;
+           page = page->next) {
+        capacity += (size_t)page->slot_count * page->slot_size;
+        used += (size_t)page->live_count * page->slot_size;
+      }
+    }
+  }
+  if (capacity == 0) {
+    return 0;
+  }
+  return 1.0 - (double)used / (double)capacity;
+}
+
+static int compareLiveCount(const void *a, const void *b) {
+  uint32_t x = (*(HeapPage *const *)a)->live_count;
+  uint32_t y = (*(HeapPage *const *)b)->live_count;
+  return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// 保留最满的若干 page, 刚好能装下该 class 所有存活 slot, 其余 page 腾空
+static int selectClass(HeapClass *cls) {
+#ifdef DEBUG_STRESS_COMPACT
+  if (cls->page_count < 1) {
+    return 0;
+  }
+#else
+  if (cls->page_count < 2) {
+    return 0;
+  }
+#endif
+  HeapPage **pages = (HeapPage **)malloc(sizeof(HeapPage *) * cls->page_count);
+  if (pages == NULL) {
+    return 0;
+  }
+  size_t live = 0;
+  int count = 0;
+  for (HeapPage *page = cls->pages; page != NULL; page = page->next) {
+    pages[count++] = page;
+    live += page->live_count;
+  }
+  qsort(pages, count, sizeof(HeapPage *), compareLiveCount);
+
+  size_t capacity = 0;
+  int keep = 0;
+  while (keep < count && capacity < live) {
+    capacity += pages[keep]->slot_count;
+    keep += 1;
+  }
+  if (keep == 0) {
+    keep = 1; // an empty spare page stays
+  }
+#ifdef DEBUG_STRESS_COMPACT
+  keep = 0; // 全部腾空, 每个对象每次都搬家
+#endif
+  for (int i = keep; i < count; i++) {
+    pages[i]->evacuating = true;
+    unlinkPartial(cls, pages[i]);
+  }
+  free(pages);
+  return count - keep;
+}
+
+int heapSelectEvacuation(Heap *heap) {
+  int selected = 0;
+  for (int kind = HEAP_OBJECT; kind <= HEAP_RAW; kind++) {
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+      selected += selectClass(&heap->classes[kind][i]);
+    }
+  }
+  return selected;
+}
+
+// 把腾空 page 中的对象复制到保留 page, moved() 负责在旧位置留下转发地址
+void heapEvacuateObjects(Heap *heap, void (*moved)(void *from, void *to)) {
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    for (HeapPage *page = heap->classes[HEAP_OBJECT][i].pages; page != NULL;
+         page = page->next) {
+      if (!page->evacuating) {
+        continue;
+      }
+      for (int w = 0; w < HEAP_BITMAP_WORDS; w++) {
+        uint64_t bits = page->allocated[w];
+        while (bits != 0) {
+          int bit = __builtin_ctzll(bits);
+          bits &= bits - 1;
+          uint8_t *from =
+              page->slots + (size_t)(w * 64 + bit) * page->slot_size;
+          void *to = heapAllocate(heap, HEAP_OBJECT, page->slot_size);
+          memcpy(to, from, page->slot_size);
+          moved(from, to);
+        }
+      }
+    }
+  }
+}
+
+static void visitPage(HeapPage *page, void (*visit)(void *object)) {
+  for (int w = 0; w < HEAP_BITMAP_WORDS; w++) {
+    uint64_t bits = page->allocated[w];
+    while (bits != 0) {
+      int bit = __builtin_ctzll(bits);
+      bits &= bits - 1;
+      visit(page->slots + (size_t)(w * 64 + bit) * page->slot_size);
+    }
+  }
+}
+
+// 遍历所有未被腾空的对象 (包括刚搬过来的)
+void heapForEachObject(Heap *heap, void (*visit)(void *object)) {
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    for (HeapPage *page = heap->classes[HEAP_OBJECT][i].pages; page != NULL;
+         page = page->next) {
+      if (!page->evacuating) {
+        visitPage(page, visit);
+      }
+    }
+  }
+  for (HeapLarge *large = heap->large; large != NULL; large = large->next) {
+    visit(large + 1);
+  }
+}
+
+// raw 块如果在腾空的 page 里就搬走, 由持有者更新指针
+void *heapRehome(Heap *heap, void *pointer, size_t size) {
+  if (pointer == NULL || size > HEAP_MAX_SMALL) {
+    return pointer;
+  }
+  HeapPage *page = HEAP_PAGE_OF(pointer);
+  if (!page->evacuating) {
+    return pointer;
+  }
+  void *result = heapAllocate(heap, HEAP_RAW, size);
+  memcpy(result, pointer, size);
+  heapFree(heap, HEAP_RAW, pointer, size);
+  return result;
+}
+
+void heapFinishEvacuation(Heap *heap) {
+  for (int kind = HEAP_OBJECT; kind <= HEAP_RAW; kind++) {
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+      HeapClass *cls = &heap->classes[kind][i];
+      HeapPage *page = cls->pages;
+      while (page != NULL) {
+        HeapPage *next = page->next;
+        if (page->evacuating) {
+          if (kind == HEAP_OBJECT) {
+            releasePage(heap, page); // every object was copied out
+          } else {
+            // raw blocks nobody could move (chunk code...) stay put
+            page->evacuating = false;
+            if (page->free_list != NULL || page->bump < page->slot_count) {
+              linkPartial(cls, page);
+            }
+          }
+        }
+        page = next;
+      }
+    }
+  }
+}
+
+static void freePages(HeapPage *page) {
+  while (page != NULL) {
+    HeapPage *next = page->next;
+    UNPOISON_SLOT(page, HEAP_PAGE_SIZE);
+    free(page);
+    page = next;
+  }
+}
+
+void freeHeap(Heap *heap) {
+  for (int kind = HEAP_OBJECT; kind <= HEAP_RAW; kind++) {
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+      freePages(heap->classes[kind][i].pages);
+    }
+  }
+  HeapLarge *large = heap->large;
+  while (large != NULL) {
+    HeapLarge *next = large->next;
+    free(large);
+    large = next;
+  }
+  initHeap(heap);
+}
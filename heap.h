@@ -0,0 +1,124 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+// VM 自己管理的分级 slab 堆
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef DEBUG_STRESS_COMPACT
+#define HEAP_PAGE_SIZE 2048 // 小 page, 测试里也能凑出可腾空的 page
+#else
+#define HEAP_PAGE_SIZE (16 * 1024) // page 按自身大小对齐
+#endif
+#define HEAP_MAX_SMALL 256         // 更大的块不走 size class
+#define HEAP_CLASS_COUNT 15
+#define HEAP_LARGE_CLASS HEAP_CLASS_COUNT
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / 16 / 64)
+
+// 任意 slab 内指针 -> 所在 page 的头部
+#define HEAP_PAGE_OF(pointer)                                                  \
+  ((HeapPage *)((uintptr_t)(pointer) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+
+typedef enum {
+  HEAP_OBJECT, // Obj structs
+  HEAP_RAW,    // string chars, table entries, upvalue arrays ...
+} HeapKind;
+
+typedef struct HeapSlot {
+  struct HeapSlot *next;
+} HeapSlot;
+
+typedef struct HeapPage {
+  struct HeapPage *prev;
+  struct HeapPage *next;
+  // pages that still have a free slot
+  struct HeapPage *prev_partial;
+  struct HeapPage *next_partial;
+  HeapSlot *free_list;
+  uint8_t *slots;
+  uint32_t slot_size;
+  uint32_t slot_recip; // ceil(2^32 / slot_size), offset -> slot index
+  uint32_t slot_count;
+  uint32_t bump; // slots at or after bump were never handed out
+  uint32_t live_count;
+  uint8_t kind;
+  uint8_t size_class;
+  uint8_t in_partial;
+  uint8_t evacuating; // compaction is moving everything out of this page
+  // GC mark bits live beside the objects, not in their headers
+  uint64_t marks[HEAP_BITMAP_WORDS];
+  uint64_t allocated[HEAP_BITMAP_WORDS]; // object pages only
+
+} HeapPage;
+
+// 超过 HEAP_MAX_SMALL 的对象单独 malloc, 头部紧挨在对象前面
+typedef struct HeapLarge {
+  struct HeapLarge *prev;
+  struct HeapLarge *next;
+  size_t size;
+  uint64_t marked;
+} HeapLarge;
+
+#define HEAP_LARGE_OF(pointer) ((HeapLarge *)(pointer)-1)
+
+typedef struct {
+  HeapPage *pages;
+  HeapPage *partial;
+  int page_count;
+} HeapClass;
+
+typedef struct {
+  HeapClass classes[2][HEAP_CLASS_COUNT]; // [HeapKind][size class]
+  HeapLarge *large;
+  size_t page_bytes;
+  size_t large_bytes;
+} Heap;
+
+static inline uint32_t heapSlotIndex(HeapPage *page, const void *pointer) {
+  uint64_t offset = (uint64_t)((const uint8_t *)pointer - page->slots);
+  return (uint32_t)((offset * page->slot_recip) >> 32);
+}
+
+static inline bool heapIsMarked(const void *pointer) {
+  HeapPage *page = HEAP_PAGE_OF(pointer);
+  uint32_t idx = heapSlotIndex(page, pointer);
+  return (page->marks[idx >> 6] >> (idx & 63)) & 1;
+}
+
+// return true if the object was already marked
+static inline bool heapMark(const void *pointer) {
+  HeapPage *page = HEAP_PAGE_OF(pointer);
+  uint32_t idx = heapSlotIndex(page, pointer);
+  uint64_t bit = (uint64_t)1 << (idx & 63);
+  if (page->marks[idx >> 6] & bit) {
+    return true;
+  }
+  page->marks[idx >> 6] |= bit;
+  return false;
+}
+
+static inline bool heapMarkLarge(const void *pointer) {
+  HeapLarge *large = HEAP_LARGE_OF(pointer);
+  if (large->marked) {
+    return true;
+  }
+  large->marked = 1;
+  return false;
+}
+
+void initHeap(Heap *heap);
+void freeHeap(Heap *heap);
+int heapSizeClass(size_t size);
+void *heapAllocate(Heap *heap, HeapKind kind, size_t size);
+void heapFree(Heap *heap, HeapKind kind, void *pointer, size_t size);
+void heapClearMarks(Heap *heap);
+void heapSweep(Heap *heap, void (*release)(void *object));
+// compaction
+double heapFragmentation(Heap *heap);
+int heapSelectEvacuation(Heap *heap);
+void heapEvacuateObjects(Heap *heap, void (*moved)(void *from, void *to));
+void heapForEachObject(Heap *heap, void (*visit)(void *object));
+void *heapRehome(Heap *heap, void *pointer, size_t size);
+void heapFinishEvacuation(Heap *heap);
+#endif
@@ -1,11 +1,16 @@
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "module.h"
+#include "parallel.h"
 #include "value.h"
 #include "vm.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void repl() {
   char line[1024];
@@ -29,47 +34,100 @@ static void repl() {
     }
   }
 }
-static char *readFile(const char *path) {
-  FILE *file = fopen(path, "rb");
-
-  if (file == NULL) {
-    fprintf(stderr, "could not open file '%s'!", path);
+static void checkResult(InterpretResult result) {
+  if (result == INTERPRET_COMPILE_ERROR) {
+    printf("compiler error.");
     exit(-1);
   }
-
-  fseek(file, 0L, SEEK_END); // 文件末端
-  size_t fileSize = ftell(file);
-  rewind(file); // 退回到起始位置
-
-  char *buffer = (char *)malloc(fileSize + 1);
-
-  if (buffer == NULL) {
-    fprintf(stderr, "not enouh memory to read \"%s\"", path);
+  if (result == INTERPRET_RUNTIME_ERROR) {
+    printf("runtime error.");    
+    exit(-1);
   }
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+}
 
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "could not read file '%s'!", path);
+static void runFile(const char *path) {
+  InterpretResult result;
+  if (isCacheFile(path)) {
+    ObjFunction *function = loadCache(path, 0);
+    if (function == NULL) {
+      fprintf(stderr, "could not load bytecode '%s'!", path);
+      exit(-1);
+    }
+    setModulePath(function, path);
+    result = interpretFunction(function);
+  } else {
+    // 旁边有对得上源码和 VM 版本的缓存就不再编译
+    char *source = readSource(path);
+    if (source == NULL) {
+      fprintf(stderr, "could not read file '%s'!", path);
+      exit(-1);
+    }
+    char *cache = cachePath(path);
+    ObjFunction *function = loadCache(cache, hashSource(source, strlen(source)));
+    free(cache);
+    if (function == NULL) {
+      function = compiler(source);
+    }
+    if (function != NULL) {
+      setModulePath(function, path);
+      result = interpretFunction(function);
+    } else {
+      result = INTERPRET_COMPILE_ERROR;
+    }
+    free(source);
   }
-  buffer[bytesRead] = '\0';
-  fclose(file);
-
-  return buffer;
+  checkResult(result);
 }
 
-static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+// clox [--jobs N] a.cl b.cl ...
+// 先并行编译全部文件, 都通过了再按命令行顺序在同一个 VM 里执行
+static void runFiles(const char **paths, int count, int jobs) {
+  CompileUnit *units = (CompileUnit *)malloc(sizeof(CompileUnit) * count);
+  if (units == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < count; i++) {
+    units[i].path = paths[i];
+  }
+  compileParallel(units, count, jobs);
+  for (int i = 0; i < count; i++) {
+    if (!units[i].ok) {
+      checkResult(INTERPRET_COMPILE_ERROR);
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    ObjFunction *function =
+        decodeCache(units[i].image.bytes, units[i].image.count);
+    free(units[i].image.bytes);
+    if (function != NULL) {
+      setModulePath(function, paths[i]);
+    }
+    checkResult(function != NULL ? interpretFunction(function)
+                                 : INTERPRET_COMPILE_ERROR);
+  }
+  free(units);
+}
 
-  if (result == INTERPRET_COMPILE_ERROR) {
+// clox --compile in.cl [-o out.cloxc]
+static void compileFile(const char *path, const char *output) {
+  char *source = readSource(path);
+  if (source == NULL) {
+    fprintf(stderr, "could not read file '%s'!", path);
+    exit(-1);
+  }
+  ObjFunction *function = compiler(source);
+  if (function == NULL) {
     printf("compiler error.");
     exit(-1);
   }
-  if (result == INTERPRET_RUNTIME_ERROR) {
-    printf("runtime error.");    
+  char *cache = output == NULL ? cachePath(path) : NULL;
+  if (!writeCache(output != NULL ? output : cache, function,
+                  hashSource(source, strlen(source)))) {
+    fprintf(stderr, "could not write '%s'!", output != NULL ? output : cache);
     exit(-1);
   }
+  free(cache);
+  free(source);
 }
 
 int main(int argc, const char *argv[]) {
@@ -79,8 +137,22 @@ int main(int argc, const char *argv[]) {
     repl();
   } else if (argc == 2) {
     runFile(argv[1]);
+  } else if (argc == 3 && strcmp(argv[1], "--lazy") == 0) {
+    // 函数体第一次调用时才编译, 语法错误也推迟到那时报告
+    vm.lazy_compile = true;
+    runFile(argv[2]);
+  } else if ((argc == 3 || (argc == 5 && strcmp(argv[3], "-o") == 0)) &&
+             strcmp(argv[1], "--compile") == 0) {
+    compileFile(argv[2], argc == 5 ? argv[4] : NULL);
+  } else if (argc >= 4 && strcmp(argv[1], "--jobs") == 0 &&
+             atoi(argv[2]) > 0) {
+    runFiles(argv + 3, argc - 3, atoi(argv[2]));
+  } else if (argc > 2 && argv[1][0] != '-') {
+    runFiles(argv + 1, argc - 1, 0);
   } else {
-    fprintf(stderr, "Usae: clox [path]\n");
+    fprintf(stderr, "Usage: clox [--lazy] [path]\n");
+    fprintf(stderr, "       clox [--jobs N] path...\n");
+    fprintf(stderr, "       clox --compile path [-o out%s]\n", CACHE_EXTENSION);
     exit(64);
   }
   freeVM();
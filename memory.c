@@ -1,6 +1,7 @@
 #include "memory.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -8,6 +9,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #ifdef DEBUG_LOG_GC
 #include "common.h"
@@ -15,33 +21,65 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_COMPACT_THRESHOLD 0.5          // 空闲比例超过一半
+#define GC_COMPACT_MIN_BYTES (256 * 1024) // 小堆不值得整理
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+// 托管内存的记账和 GC 触发点, reallocate 和对象分配都经过这里
+static void trackAllocation(size_t oldSize, size_t newSize) {
   // GC
   // 在分配前进行内存回收
   vm.bytes_allocated += newSize - oldSize;
-  //   if (newSize > oldSize) {
-  // #ifdef DEBUG_STRESS_GC
-  //     collectGarbage();
-  // #endif
-  //   }
-  // if (vm.bytes_allocated >= vm.next_gc) {
-  //   collectGarbage();
-  // }
+  if (newSize <= oldSize || vm.gc_running) {
+    return;
+  }
+#ifdef DEBUG_STRESS_GC
+  collectGarbage();
+#else
+  if (vm.bytes_allocated >= vm.next_gc) {
+    collectGarbage();
+  }
+#endif
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  trackAllocation(oldSize, newSize);
 
   if (newSize == 0) {
-    free(pointer);
+    heapFree(&vm.heap, HEAP_RAW, pointer, oldSize);
     return NULL;
   }
 
-  void *result = realloc(pointer, newSize);
-  if (result == NULL) {
-    exit(1);
+  int oldClass = pointer == NULL ? -1 : heapSizeClass(oldSize);
+  int newClass = heapSizeClass(newSize);
+  if (oldClass == newClass) {
+    if (newClass != HEAP_LARGE_CLASS) {
+      return pointer; // 同一个 size class, slot 足够大
+    }
+    void *result = realloc(pointer, newSize);
+    if (result == NULL) {
+      exit(1);
+    }
+    return result;
   }
 
+  void *result = heapAllocate(&vm.heap, HEAP_RAW, newSize);
+  if (pointer != NULL) {
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    heapFree(&vm.heap, HEAP_RAW, pointer, oldSize);
+  }
   return result;
 }
 
+Obj *allocateObjectMemory(size_t size) {
+  trackAllocation(0, size);
+  return (Obj *)heapAllocate(&vm.heap, HEAP_OBJECT, size);
+}
+
+static void freeObjectMemory(Obj *object, size_t size) {
+  vm.bytes_allocated -= size;
+  heapFree(&vm.heap, HEAP_OBJECT, object, size);
+}
+
 void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
   char *ty;
@@ -70,6 +108,9 @@ void freeObject(Obj *object) {
   case OBJ_BOUND_METHOD:
     ty = "OBJ_BOUND_METHOD";
     break;
+  case OBJ_ROPE:
+    ty = "OBJ_ROPE";
+    break;
   default:
     ty = "OTHER";
     break;
@@ -80,64 +121,83 @@ void freeObject(Obj *object) {
   switch (object->type) {
   case OBJ_STRING:
     ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+    freeObjectMemory(object, sizeof(ObjString) + string->length + 1);
     break;
   case OBJ_FUNCTION:
     ObjFunction *function = (ObjFunction *)object;
-    freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    if (object->flags & OBJ_MAPPED) {
+      freeVlaueArray(&function->chunk.constants);
+    } else {
+      freeChunk(&function->chunk);
+    }
+    if (function->lazy != NULL) {
+      freeVlaueArray(&function->lazy->upvalue_names);
+      FREE(LazyBody, function->lazy);
+    }
+    FREE_OBJ(ObjFunction, object);
     break;
   case OBJ_NATIVE:
-    FREE(ObjNative, object);
+    FREE_OBJ(ObjNative, object);
     break;
   case OBJ_CLOSURE:
     ObjClosure *closure = (ObjClosure *)object;
     FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalue_count);
-    FREE(ObjClosure, object);
+    FREE_OBJ(ObjClosure, object);
     break;
   case OBJ_UPVALUE:
-    FREE(ObjUpvalue, object);
+    FREE_OBJ(ObjUpvalue, object);
     break;
   case OBJ_CLASS:
     ObjClass *kclass = (ObjClass *)object;
-    freeTable(&kclass->methods);
-    FREE(ObjClass, object);
+    FREE_ARRAY(ObjClosure *, kclass->methods, kclass->method_count);
+    FREE_OBJ(ObjClass, object);
     break;
   case OBJ_INSTANCE:
     ObjInstance *instance = (ObjInstance *)object;
     freeTable(&instance->fields);
-    FREE(ObjInstance, object);
+    FREE_OBJ(ObjInstance, object);
     break;
   case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, object);
+    FREE_OBJ(ObjBoundMethod, object);
+    break;
+  case OBJ_ROPE:
+    FREE_OBJ(ObjRope, object);
     break;
   }
 }
 
+static void releaseObject(void *object) { freeObject((Obj *)object); }
+
 void freeObjects() {
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    Obj *next = object->next;
-    freeObject(object);
-    object = next;
-  }
+  heapSweep(&vm.heap, releaseObject);
   free(vm.gray_stack);
 }
 
+#ifdef DEBUG_LOG_GC
+// 打印 rope 会展开并分配, 回收中不能分配
+static void logObject(Obj *object) {
+  if (object->type == OBJ_ROPE && ((ObjRope *)object)->flat == NULL) {
+    printf("<rope %d>", ((ObjRope *)object)->length);
+  } else {
+    printValue(OBJ_VAL(object));
+  }
+}
+#endif
+
 void markObject(Obj *object) {
   if (object == NULL) {
     return;
   }
-  if (object->is_marked) {
+  bool marked = (object->flags & OBJ_LARGE) ? heapMarkLarge(object)
+                                             : heapMark(object);
+  if (marked) {
     return;
   }
 #ifdef DEBUG_LOG_GC
   printf("--- %p mark ", (void *)object);
-  printValue(OBJ_VAL(object));
+  logObject(object);
   printf("\n");
 #endif
-  object->is_marked = true;
   // gray mark stack
   if (vm.gray_capacity < vm.gray_count + 1) {
     vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
@@ -171,9 +231,14 @@ static void markRoots() {
   for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL;
        upvalue = upvalue->next) {
     markObject((Obj *)upvalue);
+#ifdef DEBUG_LOG_GC
     printf("==========upvalue============\n");
+#endif
   }
   markTable(&vm.globals);
+  markTable(&vm.selectors);
+  markTable(&vm.modules);
+  markArray(&vm.selector_names);
   // compiler time
   markCompilerRoots();
   markObject((Obj *)vm.init_string);
@@ -188,7 +253,7 @@ static void markArray(ValueArray *array) {
 static void blackenObject(Obj *obj) {
 #ifdef DEBUG_LOG_GC
   printf("--- %p blacken ", (void *)obj);
-  printValue(OBJ_VAL(obj));
+  logObject(obj);
   printf("\n");
 #endif
   switch (obj->type) {
@@ -201,7 +266,11 @@ static void blackenObject(Obj *obj) {
   case OBJ_FUNCTION:
     ObjFunction *func = (ObjFunction *)obj;
     markObject((Obj *)func->name);
+    markObject((Obj *)func->module);
     markArray(&func->chunk.constants);
+    if (func->lazy != NULL) {
+      markArray(&func->lazy->upvalue_names);
+    }
     break;
   case OBJ_CLOSURE:
     ObjClosure *closure = (ObjClosure *)obj;
@@ -213,7 +282,9 @@ static void blackenObject(Obj *obj) {
   case OBJ_CLASS:
     ObjClass *kclass = (ObjClass *)obj;
     markObject((Obj *)kclass->name);
-    markTable(&kclass->methods);
+    for (int i = 0; i < kclass->method_count; i++) {
+      markObject((Obj *)kclass->methods[i]);
+    }
     break;
   case OBJ_INSTANCE:
     ObjInstance *instance = (ObjInstance *)obj;
@@ -225,6 +296,12 @@ static void blackenObject(Obj *obj) {
     markValue(bound->receiver);
     markObject((Obj *)bound->method);
     break;
+  case OBJ_ROPE:
+    ObjRope *rope = (ObjRope *)obj;
+    markObject(rope->left);
+    markObject(rope->right);
+    markObject((Obj *)rope->flat);
+    break;
   }
 }
 
@@ -238,29 +315,16 @@ static void traceReferences() {
 }
 
 static void sweep() {
-  Obj *previous = NULL;
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    if (object->is_marked) {
-      object->is_marked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj *unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-        // vm.objects = previous;
-      } else {
-        vm.objects = object;
-      }
-
-      freeObject(unreached);
-    }
-  }
+  // allocated & ~marked 即为垃圾
+  heapSweep(&vm.heap, releaseObject);
+  heapClearMarks(&vm.heap);
 }
 
 void collectGarbage() {
+  if (vm.gc_running) {
+    return;
+  }
+  vm.gc_running = true;
 #ifdef DEBUG_LOG_GC
   printf("--- gc begin\n");
   // size_t before = vm.bytes_allocated;
@@ -269,11 +333,177 @@ void collectGarbage() {
   markRoots();
   traceReferences();
   tableRemoveWhite(&vm.strings);
+  for (int i = 0; i < BOUND_CACHE_SIZE; i++) {
+    if (vm.bound_cache[i] != NULL && !isMarked((Obj *)vm.bound_cache[i])) {
+      vm.bound_cache[i] = NULL;
+    }
+  }
   sweep();
+  tableShrink(&vm.strings);
   vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+#ifdef GC_COMPACT
+  // 对象在这里不能移动, 等 run() 到达 safe point 再整理
+#ifdef DEBUG_STRESS_COMPACT
+  vm.compact_pending = true;
+#else
+  if (vm.heap.page_bytes >= GC_COMPACT_MIN_BYTES &&
+      heapFragmentation(&vm.heap) > GC_COMPACT_THRESHOLD) {
+    vm.compact_pending = true;
+  }
+#endif
+#endif
+  vm.gc_running = false;
 #ifdef DEBUG_LOG_GC
   printf("--- gc end\n");
   // printf("==== collected %zu bytes (from %zu to %zu) next at %zu ====\n",
   // (before - vm.bytes_allocated), before, vm.bytes_allocated, vm.next_gc);
 #endif
-}
\ No newline at end of file
+}
+
+#ifdef GC_COMPACT
+// 搬走的对象在旧 slot 里留下转发地址, 所有对象都至少 16 字节
+typedef struct {
+  Obj obj;
+  Obj *to;
+} ObjForward;
+
+Obj *forwardObject(Obj *object) {
+  if (object != NULL && (object->flags & OBJ_FORWARDED)) {
+    return ((ObjForward *)object)->to;
+  }
+  return object;
+}
+
+void forwardValue(Value *value) {
+  if (IS_OBJ(*value)) {
+    value->as.obj = forwardObject(value->as.obj);
+  }
+}
+
+static void objectMoved(void *from, void *to) {
+  Obj *object = (Obj *)to;
+  if (object->type == OBJ_UPVALUE) {
+    // closed upvalue 指向自己的 closed 字段
+    ObjUpvalue *old = (ObjUpvalue *)from;
+    ObjUpvalue *upvalue = (ObjUpvalue *)to;
+    if (upvalue->location == &old->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+  ((Obj *)from)->flags |= OBJ_FORWARDED;
+  ((ObjForward *)from)->to = object;
+}
+
+static void relocateArray(ValueArray *array) {
+  for (uint32_t i = 0; i < array->count; i++) {
+    forwardValue(&array->values[i]);
+  }
+}
+
+static void relocateObject(void *pointer) {
+  Obj *obj = (Obj *)pointer;
+  switch (obj->type) {
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  case OBJ_UPVALUE:
+    ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+    forwardValue(&upvalue->closed);
+    upvalue->next = (ObjUpvalue *)forwardObject((Obj *)upvalue->next);
+    break;
+  case OBJ_FUNCTION:
+    ObjFunction *func = (ObjFunction *)obj;
+    func->name = (ObjString *)forwardObject((Obj *)func->name);
+    func->module = (ObjString *)forwardObject((Obj *)func->module);
+    relocateArray(&func->chunk.constants);
+    if (func->lazy != NULL) {
+      relocateArray(&func->lazy->upvalue_names);
+    }
+    break;
+  case OBJ_CLOSURE:
+    ObjClosure *closure = (ObjClosure *)obj;
+    closure->function = (ObjFunction *)forwardObject((Obj *)closure->function);
+    closure->upvalues =
+        heapRehome(&vm.heap, closure->upvalues,
+                   sizeof(ObjUpvalue *) * closure->upvalue_count);
+    for (int i = 0; i < closure->upvalue_count; i++) {
+      closure->upvalues[i] =
+          (ObjUpvalue *)forwardObject((Obj *)closure->upvalues[i]);
+    }
+    break;
+  case OBJ_CLASS:
+    ObjClass *kclass = (ObjClass *)obj;
+    kclass->name = (ObjString *)forwardObject((Obj *)kclass->name);
+    kclass->methods =
+        heapRehome(&vm.heap, kclass->methods,
+                   sizeof(ObjClosure *) * kclass->method_count);
+    for (int i = 0; i < kclass->method_count; i++) {
+      kclass->methods[i] = (ObjClosure *)forwardObject((Obj *)kclass->methods[i]);
+    }
+    break;
+  case OBJ_INSTANCE:
+    ObjInstance *instance = (ObjInstance *)obj;
+    instance->kclass = (ObjClass *)forwardObject((Obj *)instance->kclass);
+    relocateTable(&instance->fields);
+    break;
+  case OBJ_BOUND_METHOD:
+    ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+    forwardValue(&bound->receiver);
+    bound->method = (ObjClosure *)forwardObject((Obj *)bound->method);
+    break;
+  case OBJ_ROPE:
+    ObjRope *rope = (ObjRope *)obj;
+    rope->left = forwardObject(rope->left);
+    rope->right = forwardObject(rope->right);
+    rope->flat = (ObjString *)forwardObject((Obj *)rope->flat);
+    break;
+  }
+}
+
+static void relocateRoots() {
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    forwardValue(slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].closure =
+        (ObjClosure *)forwardObject((Obj *)vm.frames[i].closure);
+  }
+  // open upvalue 的 location 指向栈, 栈本身不动, 只需修正链表
+  vm.open_upvalues = (ObjUpvalue *)forwardObject((Obj *)vm.open_upvalues);
+  relocateTable(&vm.globals);
+  relocateTable(&vm.strings);
+  relocateTable(&vm.selectors);
+  relocateTable(&vm.modules);
+  relocateArray(&vm.selector_names);
+  for (int i = 0; i < BOUND_CACHE_SIZE; i++) {
+    vm.bound_cache[i] =
+        (ObjBoundMethod *)forwardObject((Obj *)vm.bound_cache[i]);
+  }
+  relocateCompilerRoots();
+  vm.init_string = (ObjString *)forwardObject((Obj *)vm.init_string);
+}
+
+// 只能在没有 C 局部变量持有对象指针的地方调用
+void compactHeap() {
+  vm.compact_pending = false;
+#ifdef DEBUG_LOG_GC
+  printf("--- compact begin\n");
+  size_t before = vm.heap.page_bytes;
+#endif
+  if (heapSelectEvacuation(&vm.heap) > 0) {
+    heapEvacuateObjects(&vm.heap, objectMoved);
+    relocateRoots();
+    heapForEachObject(&vm.heap, relocateObject);
+    heapFinishEvacuation(&vm.heap);
+#ifdef __GLIBC__
+    malloc_trim(0); // 把空出来的 page 还给操作系统
+#endif
+  } else {
+    heapFinishEvacuation(&vm.heap);
+  }
+#ifdef DEBUG_LOG_GC
+  printf("--- compact end, pages %zu -> %zu bytes\n", before,
+         vm.heap.page_bytes);
+#endif
+}
+#endif
@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "heap.h"
 #include "object.h"
 #include "value.h"
 
@@ -17,8 +18,21 @@
 
 #define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * count)
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE_OBJ(type, pointer) freeObjectMemory((Obj *)(pointer), sizeof(type))
+static inline bool isMarked(Obj *object) {
+  if (object->flags & OBJ_LARGE) {
+    return HEAP_LARGE_OF(object)->marked;
+  }
+  return heapIsMarked(object);
+}
+
 // 申请内存空间
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// 对象的 slot, 和 reallocate 一样记账并可能触发 GC
+Obj *allocateObjectMemory(size_t size);
+static void trackAllocation(size_t oldSize, size_t newSize);
+static void freeObjectMemory(Obj *object, size_t size);
+void freeObject(Obj *object);
 void freeObjects();
 void collectGarbage();
 static void markRoots();
@@ -28,4 +42,9 @@ static void traceReferences();
 static void blackenObject(Obj *obj);
 static void markArray(ValueArray *array);
 static void sweep();
+#ifdef GC_COMPACT
+void compactHeap();
+Obj *forwardObject(Obj *object);
+void forwardValue(Value *value);
+#endif
 #endif
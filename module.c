@@ -0,0 +1,99 @@
+#include "module.h"
+#include "cache.h"
+#include "compiler.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+char *readSource(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  char *buffer = size < 0 ? NULL : (char *)malloc((size_t)size + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  size_t count = fread(buffer, 1, (size_t)size, file);
+  fclose(file);
+  if (count < (size_t)size) {
+    free(buffer);
+    return NULL;
+  }
+  buffer[count] = '\0';
+  return buffer;
+}
+
+// foo/bar.cl -> foo/bar.cloxc
+char *cachePath(const char *path) {
+  size_t length = strlen(path);
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  if (dot != NULL && (slash == NULL || dot > slash)) {
+    length = dot - path;
+  }
+  char *result = (char *)malloc(length + sizeof(CACHE_EXTENSION));
+  if (result == NULL) {
+    exit(1);
+  }
+  memcpy(result, path, length);
+  memcpy(result + length, CACHE_EXTENSION, sizeof(CACHE_EXTENSION));
+  return result;
+}
+
+void setModulePath(ObjFunction *function, const char *path) {
+  char *resolved = realpath(path, NULL);
+  if (resolved == NULL) {
+    return;
+  }
+  push(OBJ_VAL(function)); // GC
+  setFunctionModule(function, copyString(resolved, (int)strlen(resolved)));
+  pop();
+  free(resolved);
+}
+
+ObjFunction *loadModule(const char *path) {
+  if (isCacheFile(path)) {
+    return loadCache(path, 0);
+  }
+  char *source = readSource(path);
+  if (source == NULL) {
+    return NULL;
+  }
+  char *cache = cachePath(path);
+  ObjFunction *function = loadCache(cache, hashSource(source, strlen(source)));
+  free(cache);
+  bool compiled = function == NULL;
+  if (compiled) {
+    function = compiler(source);
+  }
+
+  if (function != NULL && compiled && vm.lazy_compile) {
+    ModuleSource *kept = (ModuleSource *)malloc(sizeof(ModuleSource));
+    if (kept == NULL) {
+      exit(1);
+    }
+    kept->source = source;
+    kept->next = vm.module_sources;
+    vm.module_sources = kept;
+  } else {
+    free(source);
+  }
+  return function;
+}
+
+void freeModuleSources() {
+  ModuleSource *kept = vm.module_sources;
+  while (kept != NULL) {
+    ModuleSource *next = kept->next;
+    free(kept->source);
+    free(kept);
+    kept = next;
+  }
+  vm.module_sources = NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef clox_module_h
+#define clox_module_h
+// import "path"; 的模块载入, 同一个 VM 里每个文件只执行一次
+#include "common.h"
+#include "object.h"
+
+// lazy 编译的函数体指向源码, 模块的源码要留到 VM 释放
+typedef struct ModuleSource {
+  struct ModuleSource *next;
+  char *source;
+} ModuleSource;
+
+// 出错时返回 NULL, 由调用方报告
+char *readSource(const char *path);
+char *cachePath(const char *path);
+// 命令行上的脚本也记下规范路径, 它的 import 从所在目录找
+void setModulePath(ObjFunction *function, const char *path);
+// 缓存文件直接载入; 源文件旁边有对得上的缓存也不再编译
+ObjFunction *loadModule(const char *path);
+void freeModuleSources();
+#endif
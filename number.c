@@ -0,0 +1,250 @@
+#include "number.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 10^q 的 128 位尾数, 最高位为 1, 向下截断
+// 源码里没有指数写法, 超出这个范围的字面量要上百位数字, 走慢路径
+#define POW10_MIN -64
+#define POW10_MAX 64
+
+static const uint64_t pow10Table[POW10_MAX - POW10_MIN + 1][2] = {
+    {0xA87FEA27A539E9A5ull, 0x3F2398D747B36224ull}, // 1e-64
+    {0xD29FE4B18E88640Eull, 0x8EEC7F0D19A03AADull}, // 1e-63
+    {0x83A3EEEEF9153E89ull, 0x1953CF68300424ACull}, // 1e-62
+    {0xA48CEAAAB75A8E2Bull, 0x5FA8C3423C052DD7ull}, // 1e-61
+    {0xCDB02555653131B6ull, 0x3792F412CB06794Dull}, // 1e-60
+    {0x808E17555F3EBF11ull, 0xE2BBD88BBEE40BD0ull}, // 1e-59
+    {0xA0B19D2AB70E6ED6ull, 0x5B6ACEAEAE9D0EC4ull}, // 1e-58
+    {0xC8DE047564D20A8Bull, 0xF245825A5A445275ull}, // 1e-57
+    {0xFB158592BE068D2Eull, 0xEED6E2F0F0D56712ull}, // 1e-56
+    {0x9CED737BB6C4183Dull, 0x55464DD69685606Bull}, // 1e-55
+    {0xC428D05AA4751E4Cull, 0xAA97E14C3C26B886ull}, // 1e-54
+    {0xF53304714D9265DFull, 0xD53DD99F4B3066A8ull}, // 1e-53
+    {0x993FE2C6D07B7FABull, 0xE546A8038EFE4029ull}, // 1e-52
+    {0xBF8FDB78849A5F96ull, 0xDE98520472BDD033ull}, // 1e-51
+    {0xEF73D256A5C0F77Cull, 0x963E66858F6D4440ull}, // 1e-50
+    {0x95A8637627989AADull, 0xDDE7001379A44AA8ull}, // 1e-49
+    {0xBB127C53B17EC159ull, 0x5560C018580D5D52ull}, // 1e-48
+    {0xE9D71B689DDE71AFull, 0xAAB8F01E6E10B4A6ull}, // 1e-47
+    {0x9226712162AB070Dull, 0xCAB3961304CA70E8ull}, // 1e-46
+    {0xB6B00D69BB55C8D1ull, 0x3D607B97C5FD0D22ull}, // 1e-45
+    {0xE45C10C42A2B3B05ull, 0x8CB89A7DB77C506Aull}, // 1e-44
+    {0x8EB98A7A9A5B04E3ull, 0x77F3608E92ADB242ull}, // 1e-43
+    {0xB267ED1940F1C61Cull, 0x55F038B237591ED3ull}, // 1e-42
+    {0xDF01E85F912E37A3ull, 0x6B6C46DEC52F6688ull}, // 1e-41
+    {0x8B61313BBABCE2C6ull, 0x2323AC4B3B3DA015ull}, // 1e-40
+    {0xAE397D8AA96C1B77ull, 0xABEC975E0A0D081Aull}, // 1e-39
+    {0xD9C7DCED53C72255ull, 0x96E7BD358C904A21ull}, // 1e-38
+    {0x881CEA14545C7575ull, 0x7E50D64177DA2E54ull}, // 1e-37
+    {0xAA242499697392D2ull, 0xDDE50BD1D5D0B9E9ull}, // 1e-36
+    {0xD4AD2DBFC3D07787ull, 0x955E4EC64B44E864ull}, // 1e-35
+    {0x84EC3C97DA624AB4ull, 0xBD5AF13BEF0B113Eull}, // 1e-34
+    {0xA6274BBDD0FADD61ull, 0xECB1AD8AEACDD58Eull}, // 1e-33
+    {0xCFB11EAD453994BAull, 0x67DE18EDA5814AF2ull}, // 1e-32
+    {0x81CEB32C4B43FCF4ull, 0x80EACF948770CED7ull}, // 1e-31
+    {0xA2425FF75E14FC31ull, 0xA1258379A94D028Dull}, // 1e-30
+    {0xCAD2F7F5359A3B3Eull, 0x096EE45813A04330ull}, // 1e-29
+    {0xFD87B5F28300CA0Dull, 0x8BCA9D6E188853FCull}, // 1e-28
+    {0x9E74D1B791E07E48ull, 0x775EA264CF55347Dull}, // 1e-27
+    {0xC612062576589DDAull, 0x95364AFE032A819Dull}, // 1e-26
+    {0xF79687AED3EEC551ull, 0x3A83DDBD83F52204ull}, // 1e-25
+    {0x9ABE14CD44753B52ull, 0xC4926A9672793542ull}, // 1e-24
+    {0xC16D9A0095928A27ull, 0x75B7053C0F178293ull}, // 1e-23
+    {0xF1C90080BAF72CB1ull, 0x5324C68B12DD6338ull}, // 1e-22
+    {0x971DA05074DA7BEEull, 0xD3F6FC16EBCA5E03ull}, // 1e-21
+    {0xBCE5086492111AEAull, 0x88F4BB1CA6BCF584ull}, // 1e-20
+    {0xEC1E4A7DB69561A5ull, 0x2B31E9E3D06C32E5ull}, // 1e-19
+    {0x9392EE8E921D5D07ull, 0x3AFF322E62439FCFull}, // 1e-18
+    {0xB877AA3236A4B449ull, 0x09BEFEB9FAD487C2ull}, // 1e-17
+    {0xE69594BEC44DE15Bull, 0x4C2EBE687989A9B3ull}, // 1e-16
+    {0x901D7CF73AB0ACD9ull, 0x0F9D37014BF60A10ull}, // 1e-15
+    {0xB424DC35095CD80Full, 0x538484C19EF38C94ull}, // 1e-14
+    {0xE12E13424BB40E13ull, 0x2865A5F206B06FB9ull}, // 1e-13
+    {0x8CBCCC096F5088CBull, 0xF93F87B7442E45D3ull}, // 1e-12
+    {0xAFEBFF0BCB24AAFEull, 0xF78F69A51539D748ull}, // 1e-11
+    {0xDBE6FECEBDEDD5BEull, 0xB573440E5A884D1Bull}, // 1e-10
+    {0x89705F4136B4A597ull, 0x31680A88F8953030ull}, // 1e-9
+    {0xABCC77118461CEFCull, 0xFDC20D2B36BA7C3Dull}, // 1e-8
+    {0xD6BF94D5E57A42BCull, 0x3D32907604691B4Cull}, // 1e-7
+    {0x8637BD05AF6C69B5ull, 0xA63F9A49C2C1B10Full}, // 1e-6
+    {0xA7C5AC471B478423ull, 0x0FCF80DC33721D53ull}, // 1e-5
+    {0xD1B71758E219652Bull, 0xD3C36113404EA4A8ull}, // 1e-4
+    {0x83126E978D4FDF3Bull, 0x645A1CAC083126E9ull}, // 1e-3
+    {0xA3D70A3D70A3D70Aull, 0x3D70A3D70A3D70A3ull}, // 1e-2
+    {0xCCCCCCCCCCCCCCCCull, 0xCCCCCCCCCCCCCCCCull}, // 1e-1
+    {0x8000000000000000ull, 0x0000000000000000ull}, // 1e0
+    {0xA000000000000000ull, 0x0000000000000000ull}, // 1e1
+    {0xC800000000000000ull, 0x0000000000000000ull}, // 1e2
+    {0xFA00000000000000ull, 0x0000000000000000ull}, // 1e3
+    {0x9C40000000000000ull, 0x0000000000000000ull}, // 1e4
+    {0xC350000000000000ull, 0x0000000000000000ull}, // 1e5
+    {0xF424000000000000ull, 0x0000000000000000ull}, // 1e6
+    {0x9896800000000000ull, 0x0000000000000000ull}, // 1e7
+    {0xBEBC200000000000ull, 0x0000000000000000ull}, // 1e8
+    {0xEE6B280000000000ull, 0x0000000000000000ull}, // 1e9
+    {0x9502F90000000000ull, 0x0000000000000000ull}, // 1e10
+    {0xBA43B74000000000ull, 0x0000000000000000ull}, // 1e11
+    {0xE8D4A51000000000ull, 0x0000000000000000ull}, // 1e12
+    {0x9184E72A00000000ull, 0x0000000000000000ull}, // 1e13
+    {0xB5E620F480000000ull, 0x0000000000000000ull}, // 1e14
+    {0xE35FA931A0000000ull, 0x0000000000000000ull}, // 1e15
+    {0x8E1BC9BF04000000ull, 0x0000000000000000ull}, // 1e16
+    {0xB1A2BC2EC5000000ull, 0x0000000000000000ull}, // 1e17
+    {0xDE0B6B3A76400000ull, 0x0000000000000000ull}, // 1e18
+    {0x8AC7230489E80000ull, 0x0000000000000000ull}, // 1e19
+    {0xAD78EBC5AC620000ull, 0x0000000000000000ull}, // 1e20
+    {0xD8D726B7177A8000ull, 0x0000000000000000ull}, // 1e21
+    {0x878678326EAC9000ull, 0x0000000000000000ull}, // 1e22
+    {0xA968163F0A57B400ull, 0x0000000000000000ull}, // 1e23
+    {0xD3C21BCECCEDA100ull, 0x0000000000000000ull}, // 1e24
+    {0x84595161401484A0ull, 0x0000000000000000ull}, // 1e25
+    {0xA56FA5B99019A5C8ull, 0x0000000000000000ull}, // 1e26
+    {0xCECB8F27F4200F3Aull, 0x0000000000000000ull}, // 1e27
+    {0x813F3978F8940984ull, 0x4000000000000000ull}, // 1e28
+    {0xA18F07D736B90BE5ull, 0x5000000000000000ull}, // 1e29
+    {0xC9F2C9CD04674EDEull, 0xA400000000000000ull}, // 1e30
+    {0xFC6F7C4045812296ull, 0x4D00000000000000ull}, // 1e31
+    {0x9DC5ADA82B70B59Dull, 0xF020000000000000ull}, // 1e32
+    {0xC5371912364CE305ull, 0x6C28000000000000ull}, // 1e33
+    {0xF684DF56C3E01BC6ull, 0xC732000000000000ull}, // 1e34
+    {0x9A130B963A6C115Cull, 0x3C7F400000000000ull}, // 1e35
+    {0xC097CE7BC90715B3ull, 0x4B9F100000000000ull}, // 1e36
+    {0xF0BDC21ABB48DB20ull, 0x1E86D40000000000ull}, // 1e37
+    {0x96769950B50D88F4ull, 0x1314448000000000ull}, // 1e38
+    {0xBC143FA4E250EB31ull, 0x17D955A000000000ull}, // 1e39
+    {0xEB194F8E1AE525FDull, 0x5DCFAB0800000000ull}, // 1e40
+    {0x92EFD1B8D0CF37BEull, 0x5AA1CAE500000000ull}, // 1e41
+    {0xB7ABC627050305ADull, 0xF14A3D9E40000000ull}, // 1e42
+    {0xE596B7B0C643C719ull, 0x6D9CCD05D0000000ull}, // 1e43
+    {0x8F7E32CE7BEA5C6Full, 0xE4820023A2000000ull}, // 1e44
+    {0xB35DBF821AE4F38Bull, 0xDDA2802C8A800000ull}, // 1e45
+    {0xE0352F62A19E306Eull, 0xD50B2037AD200000ull}, // 1e46
+    {0x8C213D9DA502DE45ull, 0x4526F422CC340000ull}, // 1e47
+    {0xAF298D050E4395D6ull, 0x9670B12B7F410000ull}, // 1e48
+    {0xDAF3F04651D47B4Cull, 0x3C0CDD765F114000ull}, // 1e49
+    {0x88D8762BF324CD0Full, 0xA5880A69FB6AC800ull}, // 1e50
+    {0xAB0E93B6EFEE0053ull, 0x8EEA0D047A457A00ull}, // 1e51
+    {0xD5D238A4ABE98068ull, 0x72A4904598D6D880ull}, // 1e52
+    {0x85A36366EB71F041ull, 0x47A6DA2B7F864750ull}, // 1e53
+    {0xA70C3C40A64E6C51ull, 0x999090B65F67D924ull}, // 1e54
+    {0xD0CF4B50CFE20765ull, 0xFFF4B4E3F741CF6Dull}, // 1e55
+    {0x82818F1281ED449Full, 0xBFF8F10E7A8921A4ull}, // 1e56
+    {0xA321F2D7226895C7ull, 0xAFF72D52192B6A0Dull}, // 1e57
+    {0xCBEA6F8CEB02BB39ull, 0x9BF4F8A69F764490ull}, // 1e58
+    {0xFEE50B7025C36A08ull, 0x02F236D04753D5B4ull}, // 1e59
+    {0x9F4F2726179A2245ull, 0x01D762422C946590ull}, // 1e60
+    {0xC722F0EF9D80AAD6ull, 0x424D3AD2B7B97EF5ull}, // 1e61
+    {0xF8EBAD2B84E0D58Bull, 0xD2E0898765A7DEB2ull}, // 1e62
+    {0x9B934C3B330C8577ull, 0x63CC55F49F88EB2Full}, // 1e63
+    {0xC2781F49FFCFA6D5ull, 0x3CBF6B71C76B25FBull}, // 1e64
+};
+
+// 小于 2^53 的整数和 10^22 以内的幂都能精确表示, 一次乘除就是正确舍入
+static const double exactPow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static uint64_t multiplyHigh(uint64_t a, uint64_t b, uint64_t *low) {
+  unsigned __int128 product = (unsigned __int128)a * b;
+  *low = (uint64_t)product;
+  return (uint64_t)(product >> 64);
+}
+
+// Eisel-Lemire: 用截断的 10^q 尾数做一次 64x128 乘法就能定出舍入结果
+// 落在无法判定的中间位置时返回 false
+static bool eiselLemire(uint64_t mantissa, int exponent, double *result) {
+  if (exponent < POW10_MIN || exponent > POW10_MAX) {
+    return false;
+  }
+  const uint64_t *power = pow10Table[exponent - POW10_MIN];
+  int zeros = __builtin_clzll(mantissa);
+  mantissa <<= zeros;
+  // floor(log2(10^q)) + 64 + bias - zeros
+  uint64_t binary_exponent =
+      (uint64_t)(((217706 * exponent) >> 16) + 64 + 1023 - zeros);
+
+  uint64_t low;
+  uint64_t high = multiplyHigh(mantissa, power[0], &low);
+  if ((high & 0x1ff) == 0x1ff && low + mantissa < mantissa) {
+    // 低 64 位的误差可能进位到高位, 补上尾数的下半截再看
+    uint64_t extra_low;
+    uint64_t extra_high = multiplyHigh(mantissa, power[1], &extra_low);
+    uint64_t merged_high = high;
+    uint64_t merged_low = low + extra_high;
+    if (merged_low < low) {
+      merged_high += 1;
+    }
+    if ((merged_high & 0x1ff) == 0x1ff && merged_low + 1 == 0 &&
+        extra_low + mantissa < mantissa) {
+      return false;
+    }
+    high = merged_high;
+    low = merged_low;
+  }
+
+  uint64_t top = high >> 63;
+  uint64_t bits = high >> (top + 9);
+  binary_exponent -= 1 ^ top;
+  if (low == 0 && (high & 0x1ff) == 0 && (bits & 3) == 1) {
+    return false; // 正好在两个 double 中间
+  }
+  bits += bits & 1;
+  bits >>= 1;
+  if (bits >> 53 > 0) {
+    bits >>= 1;
+    binary_exponent += 1;
+  }
+  if (binary_exponent - 1 >= 0x7ff - 1) {
+    return false; // 次正规数或溢出
+  }
+  bits = binary_exponent << 52 | (bits & 0x000fffffffffffffull);
+  memcpy(result, &bits, sizeof(*result));
+  return true;
+}
+
+// 极少走到这里; token 后面紧跟着别的字符, 先复制出来再交给 strtod
+static double slowDecimal(const char *text, int length) {
+  char buffer[64];
+  char *copy =
+      length < (int)sizeof(buffer) ? buffer : (char *)malloc(length + 1);
+  if (copy == NULL) {
+    exit(1);
+  }
+  memcpy(copy, text, length);
+  copy[length] = '\0';
+  double result = strtod(copy, NULL);
+  if (copy != buffer) {
+    free(copy);
+  }
+  return result;
+}
+
+double decimalToDouble(Decimal *decimal, const char *text, int length) {
+  uint64_t mantissa = decimal->mantissa;
+  int exponent = decimal->exponent;
+  if (mantissa == 0) {
+    return 0.0;
+  }
+  if (!decimal->truncated) {
+    if (mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+      double value = (double)mantissa;
+      return exponent < 0 ? value / exactPow10[-exponent]
+                          : value * exactPow10[exponent];
+    }
+    double value;
+    if (eiselLemire(mantissa, exponent, &value)) {
+      return value;
+    }
+  } else {
+    // 真实值在 mantissa 和 mantissa + 1 之间, 两头舍入一致才算数
+    double lower;
+    double upper;
+    if (eiselLemire(mantissa, exponent, &lower) &&
+        eiselLemire(mantissa + 1, exponent, &upper) && lower == upper) {
+      return lower;
+    }
+  }
+  return slowDecimal(text, length);
+}
@@ -0,0 +1,22 @@
+#ifndef clox_number_h
+#define clox_number_h
+// 十进制字面量 -> double, 不依赖 strtod 和 locale
+#include "common.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DECIMAL_DIGITS 19 // uint64 一定放得下的十进制位数
+
+// 扫描器边走边累加: value = mantissa * 10^exponent
+// truncated: 超过 DECIMAL_DIGITS 的非零位被丢掉了
+typedef struct {
+  uint64_t mantissa;
+  int exponent;
+  int digits;
+  bool truncated;
+} Decimal;
+
+double decimalToDouble(Decimal *decimal, const char *text, int length);
+static bool eiselLemire(uint64_t mantissa, int exponent, double *result);
+static double slowDecimal(const char *text, int length);
+#endif
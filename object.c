@@ -1,22 +1,22 @@
 #include "object.h"
 #include "chunk.h"
+#include "heap.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type *)allocateObject(sizeof(type), objectType)
 
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  Obj *object = allocateObjectMemory(size);
   object->type = type;
-  object->is_marked = false;
-  object->next = vm.objects;
-  vm.objects = object;
+  object->flags = size > HEAP_MAX_SMALL ? OBJ_LARGE : 0;
 
 #ifdef DEBUG_LOG_GC
   char *ty;
@@ -45,25 +45,106 @@ static Obj *allocateObject(size_t size, ObjType type) {
   return object;
 }
 
-ObjString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// 未驻留也未哈希的字符串, 第一次用作表的键时才驻留
+ObjString *newString(int length) {
+  ObjString *string = (ObjString *)allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
+  string->hash = 0;
+  string->chars[length] = '\0';
+  return string;
+}
+
+static ObjString *addString(ObjString *string, uint32_t hash) {
   string->hash = hash;
+  string->obj.flags |= OBJ_INTERNED;
   push(OBJ_VAL(string)); // GC
   tableSet(&vm.strings, string, NIL_VAL);
   pop();
   return string;
 }
 
-// FNV-1a
+// wyhash: 一次读 8 字节, 种子来自 vm.hash_seed
+static const uint64_t WYP[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+static inline void wymum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+  wymum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
 static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  const uint8_t *p = (const uint8_t *)key;
+  size_t len = (size_t)length;
+  uint64_t seed = vm.hash_seed ^ wymix(vm.hash_seed ^ WYP[0], WYP[1]);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ WYP[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ WYP[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ WYP[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(wyr8(p) ^ WYP[1], wyr8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
   }
-  return hash;
+  a ^= WYP[1];
+  b ^= seed;
+  wymum(&a, &b);
+  return (uint32_t)wymix(a ^ WYP[0] ^ len, b ^ WYP[1]);
 }
 
 ObjString *copyString(const char *chars, int length) {
@@ -74,10 +155,9 @@ ObjString *copyString(const char *chars, int length) {
     return interned;
   }
 
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString *string = newString(length);
+  memcpy(string->chars, chars, length);
+  return addString(string, hash);
 }
 
 static void printFunction(ObjFunction *function) {
@@ -114,17 +194,39 @@ void printObject(Value value) {
   case OBJ_BOUND_METHOD:
     printFunction(AS_BOUND_METHOD(value)->method->function);
     break;
+  case OBJ_ROPE:
+    printf("%s", flattenRope(AS_ROPE(value))->chars);
+    break;
   }
 }
 
-ObjString *takeString(char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+// 返回内容相同的驻留字符串; 没有的话驻留 string 本身
+ObjString *internString(ObjString *string) {
+  if (string->obj.flags & OBJ_INTERNED) {
+    return string;
+  }
+  uint32_t hash = hashString(string->chars, string->length);
+  ObjString *interned =
+      tableFindString(&vm.strings, string->chars, string->length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
     return interned;
   }
-  return allocateString(chars, length, hash);
+  return addString(string, hash);
+}
+
+bool stringEqual(Obj *a, Obj *b) {
+  if (stringLength(a) != stringLength(b)) {
+    return false;
+  }
+  ObjString *astring = flatString(a);
+  ObjString *bstring = flatString(b);
+  if (astring == bstring) {
+    return true;
+  }
+  if (astring->obj.flags & bstring->obj.flags & OBJ_INTERNED) {
+    return false; // 都驻留过, 地址不同内容就不同
+  }
+  return memcmp(astring->chars, bstring->chars, astring->length) == 0;
 }
 
 ObjFunction *newFunction() {
@@ -132,10 +234,22 @@ ObjFunction *newFunction() {
   function->arity = 0;
   function->name = NULL;
   function->upvalue_count = 0;
+  function->lazy = NULL;
+  function->module = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
+void setFunctionModule(ObjFunction *function, ObjString *module) {
+  function->module = module;
+  for (uint32_t i = 0; i < function->chunk.constants.count; i++) {
+    Value constant = function->chunk.constants.values[i];
+    if (IS_FUNCTION(constant)) {
+      setFunctionModule(AS_FUNCTION(constant), module);
+    }
+  }
+}
+
 ObjNative *newNative(NativeFn function) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
@@ -165,7 +279,9 @@ ObjUpvalue *newUpvalue(Value *slot) {
 ObjClass *newClass(ObjString *name) {
   ObjClass *kclass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   kclass->name = name;
-  initTable(&kclass->methods);
+  kclass->methods = NULL;
+  kclass->method_count = 0;
+  kclass->field_hint = 0;
   return kclass;
 }
 
@@ -173,6 +289,11 @@ ObjInstance *newInstance(ObjClass *kclass) {
   ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->kclass = kclass;
   initTable(&instance->fields);
+  if (kclass->field_hint > 0) {
+    push(OBJ_VAL(instance)); // GC
+    tableReserve(&instance->fields, kclass->field_hint);
+    pop();
+  }
   return instance;
 }
 
@@ -181,4 +302,62 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *closure) {
   bound->receiver = receiver;
   bound->method = closure;
   return bound;
-}
\ No newline at end of file
+}
+
+ObjRope *newRope(Obj *left, Obj *right, int length) {
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+// 从右往左填充, s = s + x 这样的左深链只需要常数大小的栈
+ObjString *flattenRope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    return rope->flat;
+  }
+  push(OBJ_VAL(rope)); // GC
+  ObjString *string = newString(rope->length);
+  pop();
+  char *end = string->chars + rope->length;
+
+  Obj **stack = NULL;
+  int count = 0;
+  int capacity = 0;
+  Obj *node = (Obj *)rope;
+  while (node != NULL) {
+    ObjRope *part = node->type == OBJ_ROPE ? (ObjRope *)node : NULL;
+    if (part != NULL && part->flat == NULL) {
+      if (capacity < count + 1) {
+        capacity = GROW_CAPACITY(capacity);
+        stack = (Obj **)realloc(stack, sizeof(Obj *) * capacity);
+        if (stack == NULL) {
+          exit(1);
+        }
+      }
+      stack[count++] = part->left;
+      node = part->right;
+      continue;
+    }
+    ObjString *leaf = part != NULL ? part->flat : (ObjString *)node;
+    end -= leaf->length;
+    memcpy(end, leaf->chars, leaf->length);
+    node = count > 0 ? stack[--count] : NULL;
+  }
+  free(stack);
+
+  rope->flat = string;
+  // 子节点不再需要, 交给 GC
+  rope->left = NULL;
+  rope->right = NULL;
+  return rope->flat;
+}
+
+ObjString *flatString(Obj *object) {
+  if (object->type == OBJ_ROPE) {
+    return flattenRope((ObjRope *)object);
+  }
+  return (ObjString *)object;
+}
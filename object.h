@@ -14,6 +14,7 @@
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
@@ -23,6 +24,7 @@
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 
 typedef Value (*NativeFn)(uint8_t argCount, Value *args);
 
@@ -35,27 +37,47 @@ typedef enum {
   OBJ_CLASS,
   OBJ_INSTANCE,
   OBJ_BOUND_METHOD,
+  OBJ_ROPE,
 } ObjType;
 
+// 8 字节对象头: 没有 next 指针, sweep 直接遍历 heap page;
+// mark 位在 page 的 bitmap 中
 struct Obj {
   ObjType type;
-  bool is_marked;
-  struct Obj *next;
+  uint32_t flags;
 };
 
+#define OBJ_FORWARDED 0x1 // 整理时已搬走, 新地址紧跟在对象头后
+#define OBJ_LARGE 0x2     // 不在 slab page 里, 见 HeapLarge
+#define OBJ_INTERNED 0x4  // 字符串已在 vm.strings 中, hash 有效
+#define OBJ_MAPPED 0x8    // 函数的 code/lines 在字节码镜像里, 不归 GC 释放
+
+// 字符直接跟在对象后面, 一次分配
 struct ObjString {
   Obj obj;
   int length;
-  char *chars;
   uint32_t hash;
+  char chars[];
 };
 
+// 预扫描过但还没编译的函数体, 第一次调用时编译
+typedef struct {
+  const char *source; // 参数列表的 `(`, 源码要活到程序结束
+  int line;
+  int type; // FunctionType
+  bool in_class;
+  bool has_super_class;
+  ValueArray upvalue_names; // 按 upvalue 下标排列的外层变量名
+} LazyBody;
+
 struct ObjFunction {
   Obj obj;
   int arity; // 参数数量 number of parameters
   Chunk chunk;
   ObjString *name;
   int upvalue_count;
+  LazyBody *lazy; // NULL 表示已经编译
+  ObjString *module; // 所在文件的规范路径, import 的相对路径从它的目录算起
 };
 
 struct ObjNative {
@@ -80,9 +102,14 @@ struct ObjUpvalue {
 struct ObjClass {
   Obj obj;
   ObjString *name;
-  Table methods;
+  // vtable: 下标是全局的 selector 编号, 没有的方法为 NULL
+  ObjClosure **methods;
+  int method_count;
+  int field_hint; // 以前的实例有过几个字段, 新实例按这个预留
 };
 
+#define FIELD_HINT_MAX 32
+
 struct ObjInstance {
   Obj obj;
   ObjClass *kclass;
@@ -95,17 +122,48 @@ typedef struct ObjBoundMethod {
   ObjClosure *method;
 } ObjBoundMethod;
 
+// 字符串拼接的结果, 第一次需要字符内容时才展开
+typedef struct ObjRope {
+  Obj obj;
+  int length;
+  Obj *left; // ObjString or ObjRope
+  Obj *right;
+  ObjString *flat; // 展开后的字符串, 未驻留, 用作表的键时才驻留
+} ObjRope;
+
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
+
+static inline ObjClosure *classMethod(ObjClass *kclass, int selector) {
+  return selector < kclass->method_count ? kclass->methods[selector] : NULL;
+}
+
+static inline bool isStringValue(Value value) {
+  return IS_STRING(value) || IS_ROPE(value);
+}
+
+static inline int stringLength(Obj *object) {
+  if (object->type == OBJ_ROPE) {
+    return ((ObjRope *)object)->length;
+  }
+  return ((ObjString *)object)->length;
+}
 ObjString *copyString(const char *chars, int length);
 void printObject(Value value);
-ObjString *takeString(char *chars, int length);
+ObjString *newString(int length);
+ObjString *internString(ObjString *string);
+bool stringEqual(Obj *a, Obj *b);
 ObjFunction *newFunction();
+// 连同常量里嵌套的函数一起记下所在文件
+void setFunctionModule(ObjFunction *function, ObjString *module);
 ObjNative *newNative(NativeFn function);
 ObjClosure *newClosure(ObjFunction *function);
 ObjUpvalue *newUpvalue(Value *slot);
 ObjClass *newClass(ObjString *name);
 ObjInstance *newInstance(ObjClass *kclass);
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *closure);
+ObjRope *newRope(Obj *left, Obj *right, int length);
+ObjString *flattenRope(ObjRope *rope);
+ObjString *flatString(Obj *object);
 #endif
@@ -0,0 +1,69 @@
+#include "parallel.h"
+#include "compiler.h"
+#include "module.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void compileUnits(CompilePool *pool) {
+  int index;
+  while ((index = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+    CompileUnit *unit = &pool->units[index];
+    char *source = readSource(unit->path);
+    if (source == NULL) {
+      fprintf(stderr, "could not open file '%s'!\n", unit->path);
+      continue;
+    }
+    ObjFunction *function = compiler(source);
+    if (function != NULL) {
+      encodeCache(&unit->image, function, hashSource(source, strlen(source)));
+      unit->ok = true;
+    } else {
+      fprintf(stderr, "in '%s'\n", unit->path);
+    }
+    free(source);
+  }
+}
+
+// vm 是线程局部的, 这里的 initVM 不碰主线程的堆和 intern 表
+static void *compileWorker(void *arg) {
+  initVM();
+  compileUnits((CompilePool *)arg);
+  freeVM();
+  return NULL;
+}
+
+void compileParallel(CompileUnit *units, int count, int jobs) {
+  if (jobs <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = cores > 0 ? (int)cores : 1;
+  }
+  if (jobs > count) {
+    jobs = count;
+  }
+  CompilePool pool = {units, count, 0};
+  for (int i = 0; i < count; i++) {
+    units[i].image = (CacheWriter){NULL, 0, 0};
+    units[i].ok = false;
+  }
+
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * jobs);
+  if (threads == NULL) {
+    exit(1);
+  }
+  int started = 0;
+  while (started < jobs &&
+         pthread_create(&threads[started], NULL, compileWorker, &pool) == 0) {
+    started += 1;
+  }
+  if (started == 0) {
+    compileUnits(&pool); // 开不了线程就用当前线程的 VM 编译
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
@@ -0,0 +1,24 @@
+#ifndef clox_parallel_h
+#define clox_parallel_h
+// 多个源文件在线程池里并行编译, 每个线程用自己的 VM
+#include "cache.h"
+#include "common.h"
+#include <stdatomic.h>
+
+typedef struct {
+  const char *path;
+  CacheWriter image; // 编译结果按缓存格式序列化, 交给主线程的 VM
+  bool ok;
+} CompileUnit;
+
+typedef struct {
+  CompileUnit *units;
+  int count;
+  atomic_int next; // 下一个没人领的文件
+} CompilePool;
+
+// jobs <= 0 时按 CPU 核数开线程
+void compileParallel(CompileUnit *units, int count, int jobs);
+static void compileUnits(CompilePool *pool);
+static void *compileWorker(void *arg);
+#endif
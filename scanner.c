@@ -1,292 +1,424 @@
 #include "scanner.h"
 #include "common.h"
+#include "number.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-typedef struct {
-  const char *start;
-  const char *current;
-  int line;
-} Scanner;
+#define CHAR_DIGIT 0x1
+#define CHAR_ALPHA 0x2
+
+// 每个字符查一次表, 代替区间比较的分支链
+static const uint8_t charClass[256] = {
+    ['0' ... '9'] = CHAR_DIGIT,
+    ['a' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+};
 
-Scanner scanner;
+void initScanner(Scanner *scanner, const char *source) {
+  initScannerAt(scanner, source, 1);
+}
 
-void initScanner(const char *source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+// 从源码中间某一行接着扫描, 惰性编译函数体时用
+void initScannerAt(Scanner *scanner, const char *source, int line) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = line;
+  scanner->number = 0;
 }
 
-static bool isAtEnd() { return *scanner.current == '\0'; }
+static bool isAtEnd(Scanner *scanner) { return *scanner->current == '\0'; }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner *scanner, TokenType type) {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
   return token;
 }
 
-static Token errorToken(const char *message) {
+static Token errorToken(Scanner *scanner, const char *message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
-static char advance() {
-  char ch = *scanner.current;
-  scanner.current += 1;
+static char advance(Scanner *scanner) {
+  char ch = *scanner->current;
+  scanner->current += 1;
   return ch;
 }
 
-static bool match(char expected) {
-  if (isAtEnd()) {
+static bool match(Scanner *scanner, char expected) {
+  if (isAtEnd(scanner)) {
     return false;
   }
-  if (*scanner.current != expected) {
+  if (*scanner->current != expected) {
     return false;
   }
-  scanner.current += 1;
+  scanner->current += 1;
 
   return true;
 }
 
-static char peek() { return *scanner.current; }
-static char peekNext() {
-  if (isAtEnd()) {
+static char peek(Scanner *scanner) { return *scanner->current; }
+static char peekNext(Scanner *scanner) {
+  if (isAtEnd(scanner)) {
     return '\0';
   }
-  return scanner.current[1];
+  return scanner->current[1];
+}
+
+// 空白, 注释, 字符串和标识符都是长串同类字符, 一次判断 16 字节
+// 每块按 16 字节对齐读, 不会跨页, 可以放心读过结尾的 '\0'
+// (ASan 不知道这一点, 所以这几个函数不做检查)
+#ifdef __SSE2__
+#define BLOCK_SIZE 16
+#define NO_ASAN __attribute__((no_sanitize_address))
+#define SCALAR_PREFIX 8 // 短串逐字节更快
+
+NO_ASAN static inline __m128i loadBlock(const char *block) {
+  return _mm_load_si128((const __m128i *)block);
+}
+
+static inline __m128i eachByte(char ch) { return _mm_set1_epi8(ch); }
+
+// 去掉块里 current 之前的 skip 个字节
+static inline unsigned bitsFrom(unsigned mask, unsigned skip) {
+  return mask & (0xffffu << skip);
 }
 
-static void skipWhitespace() {
-  while (true) {
-    char ch = peek();
-    switch (ch) {
+// 返回第一个非空白字符, 顺带数跨过的换行
+NO_ASAN static const char *skipBlanks(const char *current, int *line) {
+  // 大多数间隔只有一个空格, 先逐字节看几个, 长了再成块处理
+  for (int i = 0; i < SCALAR_PREFIX; i++, current++) {
+    if (*current == '\n') {
+      *line += 1;
+    } else if (*current != ' ' && *current != '\t' && *current != '\r') {
+      return current;
+    }
+  }
+  const char *block = (const char *)((uintptr_t)current & ~(uintptr_t)15);
+  unsigned skip = (unsigned)(current - block);
+  for (;; block += BLOCK_SIZE, skip = 0) {
+    __m128i bytes = loadBlock(block);
+    __m128i newline = _mm_cmpeq_epi8(bytes, eachByte('\n'));
+    __m128i blank = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, eachByte(' ')), newline),
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, eachByte('\t')),
+                     _mm_cmpeq_epi8(bytes, eachByte('\r'))));
+    unsigned lines = bitsFrom(_mm_movemask_epi8(newline), skip);
+    unsigned stop = bitsFrom(~_mm_movemask_epi8(blank) & 0xffffu, skip);
+    if (stop != 0) {
+      *line += __builtin_popcount(lines & ((stop & -stop) - 1));
+      return block + __builtin_ctz(stop);
+    }
+    *line += __builtin_popcount(lines);
+  }
+}
+
+// 注释正文, 停在 '\n' 或 '\0'
+NO_ASAN static const char *findLineEnd(const char *current) {
+  const char *block = (const char *)((uintptr_t)current & ~(uintptr_t)15);
+  unsigned skip = (unsigned)(current - block);
+  for (;; block += BLOCK_SIZE, skip = 0) {
+    __m128i bytes = loadBlock(block);
+    __m128i end = _mm_or_si128(_mm_cmpeq_epi8(bytes, eachByte('\n')),
+                               _mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+    unsigned stop = bitsFrom(_mm_movemask_epi8(end), skip);
+    if (stop != 0) {
+      return block + __builtin_ctz(stop);
+    }
+  }
+}
+
+// 字符串正文, 停在 '"' 或 '\0', 顺带数换行
+NO_ASAN static const char *findStringEnd(const char *current, int *line) {
+  for (int i = 0; i < SCALAR_PREFIX; i++, current++) {
+    if (*current == '"' || *current == '\0') {
+      return current;
+    }
+    if (*current == '\n') {
+      *line += 1;
+    }
+  }
+  const char *block = (const char *)((uintptr_t)current & ~(uintptr_t)15);
+  unsigned skip = (unsigned)(current - block);
+  for (;; block += BLOCK_SIZE, skip = 0) {
+    __m128i bytes = loadBlock(block);
+    __m128i end = _mm_or_si128(_mm_cmpeq_epi8(bytes, eachByte('"')),
+                               _mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+    unsigned lines = bitsFrom(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, eachByte('\n'))), skip);
+    unsigned stop = bitsFrom(_mm_movemask_epi8(end), skip);
+    if (stop != 0) {
+      *line += __builtin_popcount(lines & ((stop & -stop) - 1));
+      return block + __builtin_ctz(stop);
+    }
+    *line += __builtin_popcount(lines);
+  }
+}
+
+// [A-Za-z0-9_] 之后的第一个字符; 有符号比较, 非 ASCII 字节是负数, 不算
+NO_ASAN static const char *findIdentifierEnd(const char *current) {
+  for (int i = 0; i < SCALAR_PREFIX; i++, current++) {
+    if (!(charClass[(uint8_t)*current] & (CHAR_ALPHA | CHAR_DIGIT))) {
+      return current;
+    }
+  }
+  const char *block = (const char *)((uintptr_t)current & ~(uintptr_t)15);
+  unsigned skip = (unsigned)(current - block);
+  for (;; block += BLOCK_SIZE, skip = 0) {
+    __m128i bytes = loadBlock(block);
+    __m128i lower = _mm_or_si128(bytes, eachByte(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, eachByte('a' - 1)),
+                                  _mm_cmplt_epi8(lower, eachByte('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, eachByte('0' - 1)),
+                                  _mm_cmplt_epi8(bytes, eachByte('9' + 1)));
+    __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                _mm_cmpeq_epi8(bytes, eachByte('_')));
+    unsigned stop = bitsFrom(~_mm_movemask_epi8(word) & 0xffffu, skip);
+    if (stop != 0) {
+      return block + __builtin_ctz(stop);
+    }
+  }
+}
+#else
+static const char *skipBlanks(const char *current, int *line) {
+  for (;; current++) {
+    switch (*current) {
+    case '\n':
+      *line += 1;
+      break;
     case ' ':
     case '\r':
     case '\t':
-      advance();
-      break;
-    case '\n':
-      scanner.line += 1;
-      advance();
-      break;
-    case '/':
-      if (peekNext() == '/') {
-        while (peek() != '\n' && !isAtEnd()) {
-          advance();
-        }
-      } else {
-        return;
-      }
       break;
     default:
-      return;
+      return current;
     }
   }
 }
 
-static TokenType checkKeyword(int start, int len, const char *rest,
-                              TokenType type) {
-  if (scanner.current - scanner.start == start + len &&
-      memcmp(scanner.start + start, rest, len) == 0) {
-    return type;
+static const char *findLineEnd(const char *current) {
+  while (*current != '\n' && *current != '\0') {
+    current++;
   }
-  return TOKEN_IDENTIFIER;
+  return current;
 }
 
-static TokenType identifierType() {
-  switch (*scanner.start) {
-  case 'a':
-    return checkKeyword(1, 2, "nd", TOKEN_AND);
-  case 'c':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'l':
-        return checkKeyword(2, 3, "ass", TOKEN_CLASS);
-      case 'o':
-        return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-      default:
-        return TOKEN_IDENTIFIER;
-      }
+static const char *findStringEnd(const char *current, int *line) {
+  while (*current != '"' && *current != '\0') {
+    if (*current == '\n') {
+      *line += 1;
     }
-    return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-  case 'e':
-    return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-  case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
-  case 'n':
-    return checkKeyword(1, 2, "il", TOKEN_NIL);
-  case 'o':
-    return checkKeyword(1, 1, "r", TOKEN_OR);
-  case 'p':
-    return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-  case 'r':
-    return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-  case 's':
-    return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-  case 'v':
-    return checkKeyword(1, 2, "ar", TOKEN_VAR);
-  case 'w':
-    return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-  case 'f':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'o':
-        return checkKeyword(2, 1, "r", TOKEN_FOR);
-      case 'a':
-        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-      case 'u':
-        return checkKeyword(2, 1, "n", TOKEN_FUN);
-      default:
-        return TOKEN_IDENTIFIER;
-      }
-    }
-    break;
-  case 't':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'h':
-        return checkKeyword(2, 2, "is", TOKEN_THIS);
-      case 'r':
-        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-      default:
-        return TOKEN_IDENTIFIER;
-      }
-    }
-    break;
-  case 'b':
-    return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-  default:
-    return TOKEN_IDENTIFIER;
+    current++;
+  }
+  return current;
+}
+
+static const char *findIdentifierEnd(const char *current) {
+  while (charClass[(uint8_t)*current] & (CHAR_ALPHA | CHAR_DIGIT)) {
+    current++;
   }
+  return current;
 }
+#endif
 
-static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') {
-      scanner.line += 1;
+static void skipWhitespace(Scanner *scanner) {
+  for (;;) {
+    scanner->current = skipBlanks(scanner->current, &scanner->line);
+    if (scanner->current[0] != '/' || scanner->current[1] != '/') {
+      return;
     }
-    advance();
+    scanner->current = findLineEnd(scanner->current);
   }
-  if (isAtEnd()) {
-    return errorToken("unterminated string");
+}
+
+typedef struct {
+  const char *name;
+  int length;
+  TokenType type;
+} Keyword;
+
+// 关键字的完美哈希: (首字母 + 第二个字母 * 10 + 长度) % 64 互不冲突
+// 加关键字时要重新挑系数, 保证没有两个落在同一格
+#define KEYWORD_SLOTS 64
+#define KEYWORD_MAX_LENGTH 8
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [1] = {"continue", 8, TOKEN_CONTINUE},
+    [3] = {"var", 3, TOKEN_VAR},
+    [8] = {"this", 4, TOKEN_THIS},
+    [10] = {"super", 5, TOKEN_SUPER},
+    [11] = {"nil", 3, TOKEN_NIL},
+    [12] = {"while", 5, TOKEN_WHILE},
+    [27] = {"break", 5, TOKEN_BREAK},
+    [32] = {"class", 5, TOKEN_CLASS},
+    [33] = {"else", 4, TOKEN_ELSE},
+    [37] = {"or", 2, TOKEN_OR},
+    [39] = {"if", 2, TOKEN_IF},
+    [41] = {"print", 5, TOKEN_PRINT},
+    [42] = {"return", 6, TOKEN_RETURN},
+    [44] = {"true", 4, TOKEN_TRUE},
+    [48] = {"and", 3, TOKEN_AND},
+    [49] = {"import", 6, TOKEN_IMPORT},
+    [53] = {"false", 5, TOKEN_FALSE},
+    [59] = {"fun", 3, TOKEN_FUN},
+    [63] = {"for", 3, TOKEN_FOR},
+};
+
+static TokenType identifierType(Scanner *scanner) {
+  int length = (int)(scanner->current - scanner->start);
+  if (length < 2 || length > KEYWORD_MAX_LENGTH) {
+    return TOKEN_IDENTIFIER;
+  }
+  const uint8_t *chars = (const uint8_t *)scanner->start;
+  const Keyword *keyword =
+      &keywords[(chars[0] + chars[1] * 10 + length) % KEYWORD_SLOTS];
+  if (keyword->length == length &&
+      memcmp(scanner->start, keyword->name, length) == 0) {
+    return keyword->type;
+  }
+  return TOKEN_IDENTIFIER;
+}
+
+static Token string(Scanner *scanner) {
+  scanner->current = findStringEnd(scanner->current, &scanner->line);
+  if (isAtEnd(scanner)) {
+    return errorToken(scanner, "unterminated string");
   }
 
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
-static bool isDigit(char ch) { return ch >= '0' && ch <= '9'; }
+static bool isDigit(char ch) { return charClass[(uint8_t)ch] & CHAR_DIGIT; }
+
+// 前导零不占有效位; 超出的整数位抬高指数, 超出的小数位直接丢掉
+static void addDigit(Decimal *decimal, char ch, bool fraction) {
+  if (decimal->digits < DECIMAL_DIGITS) {
+    decimal->mantissa = decimal->mantissa * 10 + (uint64_t)(ch - '0');
+    decimal->digits += decimal->mantissa != 0;
+    decimal->exponent -= fraction;
+  } else {
+    decimal->truncated = decimal->truncated || ch != '0';
+    decimal->exponent += !fraction;
+  }
+}
 
-static Token number() {
-  while (isDigit(peek())) {
-    advance();
+// 扫过数字的同时累加出值, 编译器不用再解析一遍
+static Token number(Scanner *scanner) {
+  Decimal decimal = {0, 0, 0, false};
+  addDigit(&decimal, scanner->start[0], false);
+  while (isDigit(peek(scanner))) {
+    addDigit(&decimal, advance(scanner), false);
   }
-  if (peek() == '.' && isDigit(peekNext())) {
-    advance();
-    while (isDigit(peek())) {
-      advance();
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+    advance(scanner);
+    while (isDigit(peek(scanner))) {
+      addDigit(&decimal, advance(scanner), true);
     }
   }
 
-  return makeToken(TOKEN_NUMBER);
+  scanner->number = decimalToDouble(&decimal, scanner->start,
+                                    (int)(scanner->current - scanner->start));
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static bool isAlpha(char ch) {
-  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
-}
+static bool isAlpha(char ch) { return charClass[(uint8_t)ch] & CHAR_ALPHA; }
 
-static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) {
-    advance();
-  }
-  return makeToken(identifierType());
+static Token identifier(Scanner *scanner) {
+  scanner->current = findIdentifierEnd(scanner->current);
+  return makeToken(scanner, identifierType(scanner));
 }
 
-Token scanToken() {
-  skipWhitespace();
+Token scanToken(Scanner *scanner) {
+  skipWhitespace(scanner);
 
-  scanner.start = scanner.current;
-  if (isAtEnd()) {
-    return makeToken(TOKEN_EOF);
+  scanner->start = scanner->current;
+  if (isAtEnd(scanner)) {
+    return makeToken(scanner, TOKEN_EOF);
   }
 
-  char ch = advance();
+  char ch = advance(scanner);
   TokenType type;
 
   if (isDigit(ch)) {
-    return number();
+    return number(scanner);
   }
   if (isAlpha(ch)) {
-    return identifier();
+    return identifier(scanner);
   }
 
   switch (ch) {
   case '(':
-    return makeToken(TOKEN_LEFT_PAREN);
+    return makeToken(scanner, TOKEN_LEFT_PAREN);
   case ')':
-    return makeToken(TOKEN_RIGHT_PAREN);
+    return makeToken(scanner, TOKEN_RIGHT_PAREN);
   case '{':
-    return makeToken(TOKEN_LEFT_BRACE);
+    return makeToken(scanner, TOKEN_LEFT_BRACE);
   case '}':
-    return makeToken(TOKEN_RIGHT_BRACE);
+    return makeToken(scanner, TOKEN_RIGHT_BRACE);
   case ';':
-    return makeToken(TOKEN_SEMICOLON);
+    return makeToken(scanner, TOKEN_SEMICOLON);
   case ',':
-    return makeToken(TOKEN_COMMA);
+    return makeToken(scanner, TOKEN_COMMA);
   case '.':
-    return makeToken(TOKEN_DOT);
+    return makeToken(scanner, TOKEN_DOT);
   case '+':
-    return makeToken(TOKEN_PLUS);
+    return makeToken(scanner, TOKEN_PLUS);
   case '-':
-    return makeToken(TOKEN_MINUS);
+    return makeToken(scanner, TOKEN_MINUS);
   case '*':
-    return makeToken(TOKEN_STAR);
+    return makeToken(scanner, TOKEN_STAR);
   case '/':
-    return makeToken(TOKEN_SLASH);
+    return makeToken(scanner, TOKEN_SLASH);
   case ':':
-    return makeToken(TOKEN_COLON);
+    return makeToken(scanner, TOKEN_COLON);
   case '!':
-    if (match('=')) {
+    if (match(scanner, '=')) {
       type = TOKEN_BANG_EQUAL;
     } else {
       type = TOKEN_BANG;
     }
-    return makeToken(type);
+    return makeToken(scanner, type);
   case '=':
-    if (match('=')) {
+    if (match(scanner, '=')) {
       type = TOKEN_EQUAL_EQUAL;
     } else {
       type = TOKEN_EQUAL;
     }
-    return makeToken(type);
+    return makeToken(scanner, type);
   case '>':
-    if (match('=')) {
+    if (match(scanner, '=')) {
       type = TOKEN_GREATER_EQUAL;
     } else {
       type = TOKEN_GREATER;
     }
-    return makeToken(type);
+    return makeToken(scanner, type);
   case '<':
-    if (match('=')) {
+    if (match(scanner, '=')) {
       type = TOKEN_LESS_EQUAL;
     } else {
       type = TOKEN_LESS;
     }
-    return makeToken(type);
+    return makeToken(scanner, type);
   case '\n':
-    scanner.line += 1;
-    advance();
+    scanner->line += 1;
+    advance(scanner);
     break;
   case '"':
-    return string();
+    return string(scanner);
   default:
-    return errorToken("unexpected character.");
+    return errorToken(scanner, "unexpected character.");
   }
 }
@@ -46,6 +46,7 @@ typedef enum {
   TOKEN_WHILE,
   TOKEN_BREAK,
   TOKEN_CONTINUE,
+  TOKEN_IMPORT,
   TOKEN_COLON,
   TOKEN_ERROR,
   TOKEN_EOF
@@ -58,6 +59,15 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char *source);
-Token scanToken();
+// 扫描状态, 每次编译一份
+typedef struct {
+  const char *start;
+  const char *current;
+  int line;
+  double number; // 最近扫到的数字 token 的值, 扫描时顺便算好
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *source);
+void initScannerAt(Scanner *scanner, const char *source, int line);
+Token scanToken(Scanner *scanner);
 #endif
\ No newline at end of file
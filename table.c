@@ -1,93 +1,294 @@
 #include "table.h"
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#define TABLE_MAX_LOAD 0.75 // 负载因子
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 控制字节: 最高位为 0 时低 7 位是 hash 片段
+// 删除时把后面的 entry 往回挪, 所以没有墓碑
+#define CTRL_EMPTY 0x80
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash)&0x7F))
+
+// 不超过 TABLE_SMALL_MAX 个 key 时不哈希, 紧凑存放后顺序比较指针
+#define IS_SMALL(table) ((table)->capacity <= TABLE_SMALL_MAX)
+
+// 负载因子 7/8, 小表可以放满
+static inline int maxLoad(int capacity) {
+  if (capacity <= TABLE_SMALL_MAX) {
+    return capacity;
+  }
+  return capacity - capacity / 8;
+}
+
+static inline int growCapacity(int capacity) {
+  return capacity < TABLE_SMALL_MAX ? TABLE_SMALL_MAX : capacity * 2;
+}
+
+// 能放下 count 个 key 的最小容量
+static inline int fitCapacity(int count) {
+  int capacity = TABLE_SMALL_MAX;
+  while (maxLoad(capacity) < count) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+static inline size_t tableBytes(int capacity) {
+  if (capacity <= TABLE_SMALL_MAX) {
+    return (sizeof(Value) + sizeof(ObjString *)) * (size_t)capacity;
+  }
+  return (sizeof(Value) + sizeof(ObjString *) + 1) * (size_t)capacity +
+         TABLE_GROUP_WIDTH;
+}
+
+static void setArrays(Table *table, uint8_t *block, int capacity) {
+  table->values = (Value *)block;
+  table->keys = NULL;
+  table->ctrl = NULL;
+  if (block == NULL) {
+    return;
+  }
+  table->keys = (ObjString **)(block + sizeof(Value) * capacity);
+  if (capacity > TABLE_SMALL_MAX) {
+    table->ctrl = block + (sizeof(Value) + sizeof(ObjString *)) * capacity;
+  }
+}
+
+#if defined(__SSE2__)
+static inline uint32_t groupMatch(const uint8_t *group, uint8_t h) {
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h)));
+}
+
+static inline uint32_t groupMatchEmpty(const uint8_t *group) {
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)group));
+}
+#else
+static inline uint32_t groupMatch(const uint8_t *group, uint8_t h) {
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    mask |= (uint32_t)(group[i] == h) << i;
+  }
+  return mask;
+}
+
+static inline uint32_t groupMatchEmpty(const uint8_t *group) {
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+}
+#endif
+
+// 写控制字节, 同时更新末尾的镜像
+static inline void setCtrl(Table *table, uint32_t idx, uint8_t h) {
+  uint32_t capacity = (uint32_t)table->capacity;
+  table->ctrl[idx] = h;
+  if (capacity >= TABLE_GROUP_WIDTH) {
+    if (idx < TABLE_GROUP_WIDTH) {
+      table->ctrl[capacity + idx] = h;
+    }
+  } else {
+    for (uint32_t i = idx + capacity; i < capacity + TABLE_GROUP_WIDTH;
+         i += capacity) {
+      table->ctrl[i] = h;
+    }
+  }
+}
+
+// 从 idx 开始的下一个已占用的槽, 没有时返回 capacity
+static inline int nextFull(Table *table, int idx) {
+  if (IS_SMALL(table)) {
+    return idx < table->count ? idx : table->capacity;
+  }
+  while (idx < table->capacity) {
+    uint32_t full = ~groupMatchEmpty(table->ctrl + idx) & 0xFFFF;
+    if (table->capacity - idx < TABLE_GROUP_WIDTH) {
+      full &= (1u << (table->capacity - idx)) - 1;
+    }
+    if (full != 0) {
+      return idx + __builtin_ctz(full);
+    }
+    idx += TABLE_GROUP_WIDTH;
+  }
+  return table->capacity;
+}
 
 void initTable(Table *table) {
   table->count = 0;
   table->capacity = 0;
-  table->entries = NULL;
+  table->ctrl = NULL;
+  table->keys = NULL;
+  table->values = NULL;
 }
 
 void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(uint8_t, table->values, tableBytes(table->capacity));
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  uint32_t idx = key->hash & (capacity - 1);
-  // 墓碑计数
-  Entry *tombstone = NULL;
+// 运行时拼出来的字符串到这里才驻留
+static inline ObjString *tableKey(ObjString *key) {
+  if (key->obj.flags & OBJ_INTERNED) {
+    return key;
+  }
+  return internString(key);
+}
+
+#if defined(__SSE2__)
+// 一次比较两个 key 指针; capacity 是偶数, 多读的槽在掩码里去掉
+static inline int smallFind(Table *table, ObjString *key) {
+  __m128i needle = _mm_set1_epi64x((long long)(uintptr_t)key);
+  uint32_t match = 0;
+  for (int i = 0; i < table->count; i += 2) {
+    __m128i eq = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i *)&table->keys[i]), needle);
+    eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+    match |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+  }
+  match &= (1u << table->count) - 1;
+  return match != 0 ? __builtin_ctz(match) : -1;
+}
+#else
+static inline int smallFind(Table *table, ObjString *key) {
+  for (int i = 0; i < table->count; i++) {
+    if (table->keys[i] == key) {
+      return i;
+    }
+  }
+  return -1;
+}
+#endif
+
+// 线性探测, 每次用 SIMD 比较 16 个控制字节
+static int findKey(Table *table, ObjString *key) {
+  if (IS_SMALL(table)) {
+    return smallFind(table, key);
+  }
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t pos = H1(key->hash) & mask;
+  // key 都是驻留过的指针, 大多数命中在第一个槽, 不用走 SIMD
+  if (table->keys[pos] == key) {
+    return (int)pos;
+  }
+  // 从 home 到 key 所在槽之间都不会是 EMPTY
+  if (table->ctrl[pos] == CTRL_EMPTY) {
+    return -1;
+  }
+  uint8_t h2 = H2(key->hash);
   while (true) {
-    Entry *entry = &entries[idx];
-    if (entry->key == NULL) {
-      if (entry->value.type == VAL_NIL) {
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        if (tombstone == NULL) {
-          tombstone = entry;
-        }
+    const uint8_t *group = table->ctrl + pos;
+    uint32_t match = groupMatch(group, h2);
+    while (match != 0) {
+      uint32_t idx = (pos + __builtin_ctz(match)) & mask;
+      if (table->keys[idx] == key) {
+        return (int)idx;
       }
+      match &= match - 1;
     }
-    if (entry->key == key) {
-      return entry;
+    if (groupMatchEmpty(group) != 0) {
+      return -1;
     }
-    idx = (idx + 1) & (capacity - 1);
+    pos = (pos + TABLE_GROUP_WIDTH) & mask;
   }
 }
 
-static void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+// 从 home 开始第一个 EMPTY 的槽
+static uint32_t findFree(Table *table, uint32_t hash) {
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t pos = H1(hash) & mask;
+  if (table->ctrl[pos] == CTRL_EMPTY) {
+    return pos;
   }
+  while (true) {
+    uint32_t slots = groupMatchEmpty(table->ctrl + pos);
+    if (slots != 0) {
+      return (pos + __builtin_ctz(slots)) & mask;
+    }
+    pos = (pos + TABLE_GROUP_WIDTH) & mask;
+  }
+}
 
-  table->count = 0;
+static void adjustCapacity(Table *table, int capacity) {
+  // 分配可能触发 GC, 回收时会删改 vm.strings, 之后再取旧数组
+  uint8_t *block = ALLOCATE(uint8_t, tableBytes(capacity));
+  Table old = *table;
+  setArrays(table, block, capacity);
+  table->capacity = capacity;
+  if (!IS_SMALL(table)) {
+    memset(table->ctrl, CTRL_EMPTY, capacity + TABLE_GROUP_WIDTH);
+    memset(table->keys, 0, sizeof(ObjString *) * capacity);
+  }
 
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL) {
+  int packed = 0;
+  for (int i = nextFull(&old, 0); i < old.capacity; i = nextFull(&old, i + 1)) {
+    ObjString *key = old.keys[i];
+    if (IS_SMALL(table)) {
+      table->keys[packed] = key;
+      table->values[packed++] = old.values[i];
       continue;
     }
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count += 1;
+    uint32_t idx = findFree(table, key->hash);
+    setCtrl(table, idx, H2(key->hash));
+    table->keys[idx] = key;
+    table->values[idx] = old.values[i];
   }
-  // free table->entries
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-
-  table->entries = entries;
-  table->capacity = capacity;
+  // free old arrays
+  FREE_ARRAY(uint8_t, old.values, tableBytes(old.capacity));
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  key = tableKey(key);
+  if (table->count > 0) {
+    int idx = findKey(table, key);
+    if (idx >= 0) {
+      table->values[idx] = value;
+      return false;
+    }
+  }
+  if (table->count + 1 > maxLoad(table->capacity)) {
+    adjustCapacity(table, growCapacity(table->capacity));
   }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && (entry->value.type == VAL_NIL)) {
+  if (IS_SMALL(table)) {
+    table->keys[table->count] = key;
+    table->values[table->count] = value;
     table->count++;
+    return true;
+  }
+  uint32_t idx = findFree(table, key->hash);
+  setCtrl(table, idx, H2(key->hash));
+  table->keys[idx] = key;
+  table->values[idx] = value;
+  table->count++;
+  return true;
+}
+
+// 一次分配够 count 个 key 的空间
+void tableReserve(Table *table, int count) {
+  if (count > maxLoad(table->capacity)) {
+    adjustCapacity(table, fitCapacity(count));
   }
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
 }
 
 void tableAddAll(Table *from, Table *to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
-    }
+  // 一次扩到位, 不要边复制边扩容
+  tableReserve(to, to->count + from->count);
+  for (int i = nextFull(from, 0); i < from->capacity;
+       i = nextFull(from, i + 1)) {
+    tableSet(to, from->keys[i], from->values[i]);
   }
 }
 
@@ -95,24 +296,59 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
   if (table->count == 0) {
     return false;
   }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  key = tableKey(key);
+  int idx = findKey(table, key);
+  if (idx < 0) {
     return false;
   }
-  *value = entry->value;
+  *value = table->values[idx];
   return true;
 }
 
+// backward shift: 把簇里后面能挪的 entry 填进空洞 (Knuth 6.4 Algorithm R)
+static void deleteSlot(Table *table, uint32_t hole) {
+  if (IS_SMALL(table)) {
+    // 保持插入顺序
+    int tail = table->count - 1 - (int)hole;
+    memmove(&table->keys[hole], &table->keys[hole + 1],
+            sizeof(ObjString *) * tail);
+    memmove(&table->values[hole], &table->values[hole + 1],
+            sizeof(Value) * tail);
+    table->count--;
+    return;
+  }
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t idx = hole;
+  while (true) {
+    idx = (idx + 1) & mask;
+    if (table->ctrl[idx] == CTRL_EMPTY) {
+      break;
+    }
+    uint32_t home = H1(table->keys[idx]->hash) & mask;
+    // home 不在 (hole, idx] 之间才能挪到 hole
+    if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+      setCtrl(table, hole, table->ctrl[idx]);
+      table->keys[hole] = table->keys[idx];
+      table->values[hole] = table->values[idx];
+      hole = idx;
+    }
+  }
+  setCtrl(table, hole, CTRL_EMPTY);
+  table->keys[hole] = NULL;
+  table->values[hole] = NIL_VAL;
+  table->count--;
+}
+
 bool tableDelete(Table *table, ObjString *key) {
   if (table->count == 0) {
     return false;
   }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  key = tableKey(key);
+  int idx = findKey(table, key);
+  if (idx < 0) {
     return false;
   }
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  deleteSlot(table, (uint32_t)idx);
   return true;
 }
 
@@ -121,36 +357,76 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
   if (table->count == 0) {
     return NULL;
   }
-  uint32_t idx = hash & (table->capacity - 1);
-  for (;;) {
-    Entry *entry = &table->entries[idx];
-    if (entry->key == NULL) {
-      if (entry->value.type == VAL_NIL) {
-        return NULL;
+  if (IS_SMALL(table)) {
+    for (int i = 0; i < table->count; i++) {
+      ObjString *key = table->keys[i];
+      if (key->hash == hash && key->length == length &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
       }
     }
-
-    if (entry->key->length == length && entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+    return NULL;
+  }
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t pos = H1(hash) & mask;
+  uint8_t h2 = H2(hash);
+  while (true) {
+    const uint8_t *group = table->ctrl + pos;
+    uint32_t match = groupMatch(group, h2);
+    while (match != 0) {
+      ObjString *key = table->keys[(pos + __builtin_ctz(match)) & mask];
+      if (key->hash == hash && key->length == length &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
+      match &= match - 1;
     }
-    idx = (idx + 1) & (table->capacity - 1);
+    if (groupMatchEmpty(group) != 0) {
+      return NULL;
+    }
+    pos = (pos + TABLE_GROUP_WIDTH) & mask;
   }
 }
 
 void markTable(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    markObject((Obj *)entry->key);
-    markValue(entry->value);
+  for (int i = nextFull(table, 0); i < table->capacity;
+       i = nextFull(table, i + 1)) {
+    markObject((Obj *)table->keys[i]);
+    markValue(table->values[i]);
   }
 }
 
 void tableRemoveWhite(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
-      tableDelete(table, entry->key);
+  int i = nextFull(table, 0);
+  while (i < table->capacity) {
+    if (!isMarked((Obj *)table->keys[i])) {
+      // 后面的 entry 可能挪进 i, 再看一遍
+      deleteSlot(table, (uint32_t)i);
+      i = nextFull(table, i);
+    } else {
+      i = nextFull(table, i + 1);
     }
   }
-}
\ No newline at end of file
+}
+
+// sweep 之后很空的表缩回去, 之后的遍历只和 count 成正比.
+// 要分配新数组, 只能在 sweep 之后调用
+void tableShrink(Table *table) {
+  if (!IS_SMALL(table) && table->count <= table->capacity / 8) {
+    adjustCapacity(table, fitCapacity(table->count * 2));
+  }
+}
+
+#ifdef GC_COMPACT
+// 更新整理后搬走的 key/value, 顺便把数组移出待腾空的 page
+void relocateTable(Table *table) {
+  uint8_t *block = heapRehome(&vm.heap, table->values,
+                              tableBytes(table->capacity));
+  setArrays(table, block, table->capacity);
+  for (int i = nextFull(table, 0); i < table->capacity;
+       i = nextFull(table, i + 1)) {
+    table->keys[i] = (ObjString *)forwardObject((Obj *)table->keys[i]);
+    forwardValue(&table->values[i]);
+  }
+}
+#endif
@@ -3,20 +3,31 @@
 #include "common.h"
 #include "value.h"
 
+#define TABLE_GROUP_WIDTH 16 // 一次探测 16 个控制字节
+#define TABLE_SMALL_MAX 4     // 不超过这么多 key 时线性查找
+
+// SwissTable: 控制字节和 key/value 分开存放
+// capacity <= TABLE_SMALL_MAX 时没有 ctrl, 前 count 个槽紧凑存放
 typedef struct {
-  int count;
-  int capacity;
-  Entry *entries;
+  int count;       // live keys
+  int capacity;    // 0 or a power of two
+  // capacity + TABLE_GROUP_WIDTH bytes, 末尾是开头的镜像
+  uint8_t *ctrl;
+  ObjString **keys;
+  Value *values; // 三个数组在同一块内存里, values 在最前
 } Table;
 
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableSet(Table *table, ObjString *key, Value value);
 void tableAddAll(Table *from, Table *to);
+void tableReserve(Table *table, int count);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableDelete(Table *table, ObjString *key);
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash);
 void markTable(Table *table);
 void tableRemoveWhite(Table *table);
+void tableShrink(Table *table);
+void relocateTable(Table *table);
 #endif
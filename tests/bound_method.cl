@@ -0,0 +1,50 @@
+// bound method: 同一个接收者的同一个方法总是相等, 不管取到的是缓存里的
+// 还是新分配的; clox_stress 每次分配都回收, 缓存里的弱引用一直被清掉
+class Box {
+  init(value) { this.value = value; }
+  get() { return this.value; }
+  add(n) { return this.value + n; }
+}
+
+var box = Box(3);
+var other = Box(3);
+var errors = 0;
+var i = 0;
+while (i < 100) {
+  var a = box.get;
+  var junk = "junk " + "string" + " to collect";
+  var b = box.get;
+  if (a != b or !(a == b)) {
+    errors = errors + 1;
+  }
+  // 接收者或方法不同就不相等
+  if (a == other.get or a == box.add) {
+    errors = errors + 1;
+  }
+  if (a() != 3) {
+    errors = errors + 1;
+  }
+  // (obj.m)(args) 编译成 OP_INVOKE
+  if ((box.add)(i) != i + 3) {
+    errors = errors + 1;
+  }
+  i = i + 1;
+}
+
+// 第一次取到的 bound method 活过很多次回收, 仍然和新取的相等
+var kept = box.get;
+var j = 0;
+while (j < 50) {
+  var garbage = Box(j);
+  var method = garbage.get;
+  j = j + 1;
+}
+if (kept != box.get or kept() != 3) {
+  errors = errors + 1;
+}
+
+if (errors == 0) {
+  print "bound method " + "ok";
+} else {
+  print errors;
+}
@@ -0,0 +1,108 @@
+// 把编译好的缓存截断或翻转一位再交给 clox 运行.
+// 坏掉的缓存只能被拒绝或者报运行时错误, 不能让 VM 崩溃
+// 用法: cache_corrupt <clox> <script.cl>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define GOOD_IMAGE "cache_corrupt_good.cloxc"
+#define BAD_IMAGE "cache_corrupt_bad.cloxc"
+
+static const char *clox;
+
+// 返回让子进程崩溃的信号, 正常退出 (包括报错) 返回 0
+static int run(char *const args[]) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    exit(1);
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    alarm(2); // 翻坏的跳转可能变成死循环, 超时不算崩溃
+    execv(clox, args);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    exit(1);
+  }
+  if (WIFSIGNALED(status) && WTERMSIG(status) != SIGALRM) {
+    return WTERMSIG(status);
+  }
+  return 0;
+}
+
+static unsigned char *readImage(size_t *size) {
+  FILE *file = fopen(GOOD_IMAGE, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0L, SEEK_END);
+  *size = (size_t)ftell(file);
+  rewind(file);
+  unsigned char *bytes = (unsigned char *)malloc(*size);
+  if (bytes == NULL || fread(bytes, 1, *size, file) != *size) {
+    exit(1);
+  }
+  fclose(file);
+  return bytes;
+}
+
+static int runBad(const unsigned char *bytes, size_t size) {
+  FILE *file = fopen(BAD_IMAGE, "wb");
+  if (file == NULL || fwrite(bytes, 1, size, file) != size) {
+    exit(1);
+  }
+  fclose(file);
+  char *const args[] = {(char *)clox, BAD_IMAGE, NULL};
+  return run(args);
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: cache_corrupt <clox> <script>\n");
+    return 2;
+  }
+  clox = argv[1];
+  char *const compile[] = {(char *)clox, "--compile", (char *)argv[2], "-o",
+                           GOOD_IMAGE, NULL};
+  remove(GOOD_IMAGE);
+  if (run(compile) != 0) {
+    return 1;
+  }
+  size_t size = 0;
+  unsigned char *bytes = readImage(&size);
+  if (bytes == NULL || size == 0) {
+    fprintf(stderr, "can't compile %s\n", argv[2]);
+    return 1;
+  }
+
+  int failures = 0;
+  for (size_t length = 0; length < size; length++) {
+    int signal = runBad(bytes, length);
+    if (signal != 0) {
+      fprintf(stderr, "truncated to %zu bytes: signal %d\n", length, signal);
+      failures++;
+    }
+  }
+  for (size_t i = 0; i < size; i++) {
+    unsigned char bit = (unsigned char)(1 << (i % 8));
+    bytes[i] ^= bit;
+    int signal = runBad(bytes, size);
+    bytes[i] ^= bit;
+    if (signal != 0) {
+      fprintf(stderr, "bit %zu of byte %zu flipped: signal %d\n", i % 8, i,
+              signal);
+      failures++;
+    }
+  }
+  free(bytes);
+  remove(BAD_IMAGE);
+  printf("%zu corrupted images, %d crashed\n", 2 * size, failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,42 @@
+// 给 cache_corrupt 用的小脚本, 尽量覆盖各种指令
+class Shape {
+  init(name) { this.name = name; }
+  area() { return 0; }
+  describe() { return this.name + " " + "shape"; }
+}
+
+class Square < Shape {
+  init(side) {
+    super.init("square");
+    this.side = side;
+  }
+  area() { return this.side * this.side; }
+  describe() { return super.describe() + "!"; }
+}
+
+fun adder(n) {
+  var total = n;
+  fun add(x) {
+    total = total + x;
+    return total;
+  }
+  return add;
+}
+
+var add = adder(1);
+var sum = 0;
+for (var i = 0; i < 3; i = i + 1) {
+  var shape = Square(i);
+  if (shape.area() > 1 and !(i == 0)) {
+    sum = sum + shape.area();
+  } else {
+    sum = sum - 1;
+  }
+  add(i);
+}
+var text = Square(2).describe();
+if (sum == 2 and add(0) == 4 and text == "square shape!") {
+  print "cache image " + "ok";
+} else {
+  print sum;
+}
@@ -0,0 +1,95 @@
+// GC 压力测试: 长命对象之间夹着大量短命的字符串, 闭包, 实例和 bound method.
+// 用 clox_stress 跑时每次分配都回收, 每个 safe point 都把对象整体搬一遍
+class Node {
+  init(value, next) {
+    this.value = value;
+    this.next = next;
+    this.tag = "node-" + "tag";
+  }
+  get() { return this.value; }
+}
+
+class Counted < Node {
+  init(value, next) {
+    super.init(value, next);
+    this.extra = value * 2;
+  }
+}
+
+fun counter() {
+  var count = 0;
+  fun inc() {
+    count = count + 1;
+    return count;
+  }
+  return inc;
+}
+
+var keep = nil;
+var inc = counter();
+var text = "";
+var errors = 0;
+var every = 0;
+var i = 0;
+while (i < 120) {
+  // 短命: 下一轮就不可达
+  var junk = Node(i, Node(i + 1, nil));
+  var bound = junk.get;
+  var other = counter();
+  other();
+  var piece = "piece " + "of " + "garbage";
+  junk.next.tag = piece + piece;
+  if (bound() != i) {
+    errors = errors + 1;
+  }
+
+  // 长命
+  every = every + 1;
+  if (every == 3) {
+    keep = Counted(i, keep);
+    every = 0;
+  }
+  inc();
+  text = text + "ab";
+  i = i + 1;
+}
+
+var total = 0;
+var extra = 0;
+var node = keep;
+var count = 0;
+while (count < 40) {
+  total = total + node.get();
+  extra = extra + node.extra;
+  if (node.tag != "node-tag") {
+    errors = errors + 1;
+  }
+  node = node.next;
+  count = count + 1;
+}
+
+var expected = "";
+var j = 0;
+while (j < 120) {
+  expected = expected + "ab";
+  j = j + 1;
+}
+
+if (total != 2420) {
+  errors = errors + 1;
+}
+if (extra != 4840) {
+  errors = errors + 1;
+}
+if (inc() != 121) {
+  errors = errors + 1;
+}
+if (text != expected) {
+  errors = errors + 1;
+}
+
+if (errors == 0) {
+  print "gc stress " + "ok";
+} else {
+  print errors;
+}
@@ -0,0 +1,9 @@
+// import 的相对路径从本文件所在目录算起, 和 ctest 的工作目录无关
+import "modules/greet.cl";
+import "modules/../modules/greet.cl";
+
+if (greet("lox") == "hi lox!") {
+  print "import " + "ok";
+} else {
+  print greet("lox");
+}
@@ -0,0 +1,12 @@
+// --jobs: 几个文件并行编译, 再按命令行顺序在同一个 VM 里执行
+var shared = "shared " + "text";
+var literal = "only literal";
+
+class Shape {
+  init(size) { this.size = size; }
+  area() { return this.size * this.size; }
+}
+
+fun twice(f, x) {
+  return f(f(x));
+}
@@ -0,0 +1,13 @@
+// 用到 first.cl 定义的全局变量和类, 方法名在各个 worker 里编号不同
+class Square < Shape {
+  area() { return super.area() + 0; }
+  scale(n) { return Square(this.size * n); }
+}
+
+fun inc(x) { return x + 1; }
+
+var square = Square(3).scale(2);
+var errors = 0;
+if (square.area() != 36 or twice(inc, 5) != 7) {
+  errors = errors + 1;
+}
@@ -0,0 +1,13 @@
+// 不同文件里相同的字符串常量解码后要是同一个串
+if (literal != "only literal" or shared != "shared text") {
+  errors = errors + 1;
+}
+if (Square(4).area() != Shape(4).area()) {
+  errors = errors + 1;
+}
+
+if (errors == 0) {
+  print "jobs ok";
+} else {
+  print errors;
+}
@@ -0,0 +1,85 @@
+// --lazy: 函数体第一次调用时才编译. 不加 --lazy 跑同一个脚本结果要一样
+var errors = 0;
+
+// 递归: 函数体编译时自己已经是全局变量
+fun fib(n) {
+  if (n < 2) return n;
+  return fib(n - 1) + fib(n - 2);
+}
+if (fib(15) != 610) {
+  errors = errors + 1;
+}
+
+// 多层闭包: 最里层捕获两层外面的局部变量
+fun outer() {
+  var a = 1;
+  fun middle() {
+    var b = 10;
+    fun inner() {
+      a = a + 1;
+      return a + b;
+    }
+    return inner;
+  }
+  return middle;
+}
+var inner = outer()();
+inner();
+if (inner() != 13) {
+  errors = errors + 1;
+}
+
+// 函数体里有和外层同名的局部变量, 预扫描会多捕获一个, 不影响结果
+fun shadow() {
+  var x = "outer";
+  fun f() {
+    var x = "inner";
+    return x;
+  }
+  fun g() {
+    return x;
+  }
+  return f() + " " + g();
+}
+if (shadow() != "inner outer") {
+  errors = errors + 1;
+}
+
+// 方法和 super 调用, 方法体同样延迟编译
+class Base {
+  init(n) { this.n = n; }
+  value() { return this.n; }
+}
+class Derived < Base {
+  init(n) { super.init(n * 2); }
+  value() { return super.value() + 1; }
+}
+if (Derived(20).value() != 41) {
+  errors = errors + 1;
+}
+
+// 同一个函数多次创建闭包, 只编译一次
+fun adder(n) {
+  fun add(x) { return x + n; }
+  return add;
+}
+var sum = 0;
+var i = 0;
+while (i < 5) {
+  sum = sum + adder(i)(100);
+  i = i + 1;
+}
+if (sum != 510) {
+  errors = errors + 1;
+}
+
+// 从来不调用的函数不会编译
+fun unused() {
+  return undefinedName;
+}
+
+if (errors == 0) {
+  print "lazy ok";
+} else {
+  print errors;
+}
@@ -0,0 +1,341 @@
+// 超过 256 个常量: 全局变量, 类, 闭包, 属性和 import 都要用 _LONG 指令
+// 前 300 个全局变量的名字和值先把短指令的常量下标用完
+var g0 = 0;
+var g1 = 7;
+var g2 = 14;
+var g3 = 21;
+var g4 = 28;
+var g5 = 35;
+var g6 = 42;
+var g7 = 49;
+var g8 = 56;
+var g9 = 63;
+var g10 = 70;
+var g11 = 77;
+var g12 = 84;
+var g13 = 91;
+var g14 = 98;
+var g15 = 105;
+var g16 = 112;
+var g17 = 119;
+var g18 = 126;
+var g19 = 133;
+var g20 = 140;
+var g21 = 147;
+var g22 = 154;
+var g23 = 161;
+var g24 = 168;
+var g25 = 175;
+var g26 = 182;
+var g27 = 189;
+var g28 = 196;
+var g29 = 203;
+var g30 = 210;
+var g31 = 217;
+var g32 = 224;
+var g33 = 231;
+var g34 = 238;
+var g35 = 245;
+var g36 = 252;
+var g37 = 259;
+var g38 = 266;
+var g39 = 273;
+var g40 = 280;
+var g41 = 287;
+var g42 = 294;
+var g43 = 301;
+var g44 = 308;
+var g45 = 315;
+var g46 = 322;
+var g47 = 329;
+var g48 = 336;
+var g49 = 343;
+var g50 = 350;
+var g51 = 357;
+var g52 = 364;
+var g53 = 371;
+var g54 = 378;
+var g55 = 385;
+var g56 = 392;
+var g57 = 399;
+var g58 = 406;
+var g59 = 413;
+var g60 = 420;
+var g61 = 427;
+var g62 = 434;
+var g63 = 441;
+var g64 = 448;
+var g65 = 455;
+var g66 = 462;
+var g67 = 469;
+var g68 = 476;
+var g69 = 483;
+var g70 = 490;
+var g71 = 497;
+var g72 = 504;
+var g73 = 511;
+var g74 = 518;
+var g75 = 525;
+var g76 = 532;
+var g77 = 539;
+var g78 = 546;
+var g79 = 553;
+var g80 = 560;
+var g81 = 567;
+var g82 = 574;
+var g83 = 581;
+var g84 = 588;
+var g85 = 595;
+var g86 = 602;
+var g87 = 609;
+var g88 = 616;
+var g89 = 623;
+var g90 = 630;
+var g91 = 637;
+var g92 = 644;
+var g93 = 651;
+var g94 = 658;
+var g95 = 665;
+var g96 = 672;
+var g97 = 679;
+var g98 = 686;
+var g99 = 693;
+var g100 = 700;
+var g101 = 707;
+var g102 = 714;
+var g103 = 721;
+var g104 = 728;
+var g105 = 735;
+var g106 = 742;
+var g107 = 749;
+var g108 = 756;
+var g109 = 763;
+var g110 = 770;
+var g111 = 777;
+var g112 = 784;
+var g113 = 791;
+var g114 = 798;
+var g115 = 805;
+var g116 = 812;
+var g117 = 819;
+var g118 = 826;
+var g119 = 833;
+var g120 = 840;
+var g121 = 847;
+var g122 = 854;
+var g123 = 861;
+var g124 = 868;
+var g125 = 875;
+var g126 = 882;
+var g127 = 889;
+var g128 = 896;
+var g129 = 903;
+var g130 = 910;
+var g131 = 917;
+var g132 = 924;
+var g133 = 931;
+var g134 = 938;
+var g135 = 945;
+var g136 = 952;
+var g137 = 959;
+var g138 = 966;
+var g139 = 973;
+var g140 = 980;
+var g141 = 987;
+var g142 = 994;
+var g143 = 1001;
+var g144 = 1008;
+var g145 = 1015;
+var g146 = 1022;
+var g147 = 1029;
+var g148 = 1036;
+var g149 = 1043;
+var g150 = 1050;
+var g151 = 1057;
+var g152 = 1064;
+var g153 = 1071;
+var g154 = 1078;
+var g155 = 1085;
+var g156 = 1092;
+var g157 = 1099;
+var g158 = 1106;
+var g159 = 1113;
+var g160 = 1120;
+var g161 = 1127;
+var g162 = 1134;
+var g163 = 1141;
+var g164 = 1148;
+var g165 = 1155;
+var g166 = 1162;
+var g167 = 1169;
+var g168 = 1176;
+var g169 = 1183;
+var g170 = 1190;
+var g171 = 1197;
+var g172 = 1204;
+var g173 = 1211;
+var g174 = 1218;
+var g175 = 1225;
+var g176 = 1232;
+var g177 = 1239;
+var g178 = 1246;
+var g179 = 1253;
+var g180 = 1260;
+var g181 = 1267;
+var g182 = 1274;
+var g183 = 1281;
+var g184 = 1288;
+var g185 = 1295;
+var g186 = 1302;
+var g187 = 1309;
+var g188 = 1316;
+var g189 = 1323;
+var g190 = 1330;
+var g191 = 1337;
+var g192 = 1344;
+var g193 = 1351;
+var g194 = 1358;
+var g195 = 1365;
+var g196 = 1372;
+var g197 = 1379;
+var g198 = 1386;
+var g199 = 1393;
+var g200 = 1400;
+var g201 = 1407;
+var g202 = 1414;
+var g203 = 1421;
+var g204 = 1428;
+var g205 = 1435;
+var g206 = 1442;
+var g207 = 1449;
+var g208 = 1456;
+var g209 = 1463;
+var g210 = 1470;
+var g211 = 1477;
+var g212 = 1484;
+var g213 = 1491;
+var g214 = 1498;
+var g215 = 1505;
+var g216 = 1512;
+var g217 = 1519;
+var g218 = 1526;
+var g219 = 1533;
+var g220 = 1540;
+var g221 = 1547;
+var g222 = 1554;
+var g223 = 1561;
+var g224 = 1568;
+var g225 = 1575;
+var g226 = 1582;
+var g227 = 1589;
+var g228 = 1596;
+var g229 = 1603;
+var g230 = 1610;
+var g231 = 1617;
+var g232 = 1624;
+var g233 = 1631;
+var g234 = 1638;
+var g235 = 1645;
+var g236 = 1652;
+var g237 = 1659;
+var g238 = 1666;
+var g239 = 1673;
+var g240 = 1680;
+var g241 = 1687;
+var g242 = 1694;
+var g243 = 1701;
+var g244 = 1708;
+var g245 = 1715;
+var g246 = 1722;
+var g247 = 1729;
+var g248 = 1736;
+var g249 = 1743;
+var g250 = 1750;
+var g251 = 1757;
+var g252 = 1764;
+var g253 = 1771;
+var g254 = 1778;
+var g255 = 1785;
+var g256 = 1792;
+var g257 = 1799;
+var g258 = 1806;
+var g259 = 1813;
+var g260 = 1820;
+var g261 = 1827;
+var g262 = 1834;
+var g263 = 1841;
+var g264 = 1848;
+var g265 = 1855;
+var g266 = 1862;
+var g267 = 1869;
+var g268 = 1876;
+var g269 = 1883;
+var g270 = 1890;
+var g271 = 1897;
+var g272 = 1904;
+var g273 = 1911;
+var g274 = 1918;
+var g275 = 1925;
+var g276 = 1932;
+var g277 = 1939;
+var g278 = 1946;
+var g279 = 1953;
+var g280 = 1960;
+var g281 = 1967;
+var g282 = 1974;
+var g283 = 1981;
+var g284 = 1988;
+var g285 = 1995;
+var g286 = 2002;
+var g287 = 2009;
+var g288 = 2016;
+var g289 = 2023;
+var g290 = 2030;
+var g291 = 2037;
+var g292 = 2044;
+var g293 = 2051;
+var g294 = 2058;
+var g295 = 2065;
+var g296 = 2072;
+var g297 = 2079;
+var g298 = 2086;
+var g299 = 2093;
+var errors = 0;
+
+// OP_GET_GLOBAL_LONG / OP_SET_GLOBAL_LONG
+if (g0 + g150 + g299 != 3143) {
+  errors = errors + 1;
+}
+g299 = g299 + 1;
+if (g299 != 2094) {
+  errors = errors + 1;
+}
+
+// OP_CONSTANT_LONG
+if ("late " + "string" != "late string" or 1234.5 + 0.5 != 1235) {
+  errors = errors + 1;
+}
+
+// OP_CLASS_LONG, OP_CLOSURE_LONG, OP_SET_PROPERTY_LONG, OP_GET_PROPERTY_LONG
+class Late {
+  init(n) { this.n = n; }
+  get() { return this.n; }
+}
+fun lateAdd(a, b) { return a + b; }
+var late = Late(40);
+late.extra = 2;
+if (lateAdd(late.get(), late.extra) != 42 or late.n != 40) {
+  errors = errors + 1;
+}
+
+// OP_IMPORT_LONG
+import "modules/greet.cl";
+if (greet("long") != "hi long!") {
+  errors = errors + 1;
+}
+
+if (errors == 0) {
+  print "long ok";
+} else {
+  print errors;
+}
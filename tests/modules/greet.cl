@@ -0,0 +1,3 @@
+// 被 tests/import.cl 导入; 再导入同目录的文件, 路径相对于本文件
+import "shout.cl";
+fun greet(name) { return shout("hi " + name); }
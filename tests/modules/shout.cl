@@ -0,0 +1 @@
+fun shout(text) { return text + "!"; }
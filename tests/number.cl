@@ -0,0 +1,42 @@
+// 数字字面量: 快路径, Eisel-Lemire 和 strtod 兜底都要和正确舍入的结果一致
+var errors = 0;
+
+fun check(ok) {
+  if (!ok) {
+    errors = errors + 1;
+  }
+}
+
+// 小于 2^53 且只缩放 10^22 以内的直接乘除
+check(000123.4500 == 123.45);
+check(0.0000152587890625 == 1 / 65536);
+check(0.1 + 0.2 == 0.30000000000000004);
+check(0.1 * 3 == 0.30000000000000004);
+check(4.35 * 100 == 434.99999999999994);
+
+// 超过 2^53: 正好在中间时舍入到偶数
+check(9007199254740993 == 9007199254740992);
+check(9007199254740995 == 9007199254740996);
+check(9007199254740993.0000000000000000000001 == 9007199254740994);
+check(9007199254740992.9999999999999999999999 == 9007199254740992);
+
+// 超过 19 位有效数字
+check(18446744073709551616 == 4294967296 * 4294967296);
+check(100000000000000000000000 == 10000000000 * 10000000000000);
+check(0.30000000000000000000000000001 == 0.3);
+
+// 0.1 和下一个 double 的正中间, 以及比它大一点点
+check(0.100000000000000012490009027033011079765856266021728515625 == 0.1);
+check(0.1000000000000000124900090270330110797658562660217285156251 ==
+      0.10000000000000002);
+
+// 超出 10^64 表的长字面量
+check(1.00000000000000000000000000000000000000000000000000000000000000000000000000000000 == 1);
+check(10000000000000000000000000000000000000000000000000000000000000000000000 >
+      1000000000000000000000000000000000000000000000000000000000000000000000);
+
+if (errors == 0) {
+  print "number ok";
+} else {
+  print errors;
+}
@@ -0,0 +1,53 @@
+// rope: 长拼接先不复制, 打印, 比较和当表的键时才展开
+var part = "0123456789abcdefghijklmnopqrstuvwxyz0123456789";
+var errors = 0;
+
+// 左深链: s = s + x
+var s = "";
+var i = 0;
+while (i < 30) {
+  s = s + part;
+  i = i + 1;
+}
+var flat = "";
+var j = 0;
+while (j < 30) {
+  flat = flat + part;
+  j = j + 1;
+}
+if (s != flat) {
+  errors = errors + 1;
+}
+
+// 右深和两边都是 rope
+var left = part + part;
+var right = part + (part + part);
+if (left + right != part + part + part + part + part) {
+  errors = errors + 1;
+}
+if (left + right == part + part + part + part) {
+  errors = errors + 1;
+}
+
+// rope 和普通字符串比较
+var same = "0123456789abcdefghijklmnopqrstuvwxyz01234567890123456789abcdefghijklmnopqrstuvwxyz0123456789";
+if (left != same or same != left) {
+  errors = errors + 1;
+}
+
+// 脚本里表的键只能是名字常量, rope 作为字段和全局变量的值进表
+class Box {}
+var box = Box();
+box.value = left;
+var global = right + left;
+box.value = box.value + left;
+if (box.value != same + same or global != right + same) {
+  errors = errors + 1;
+}
+
+// 打印 rope 时它已经出栈, 展开的分配不能把它回收掉
+var pad = "----------------------------------------";
+print pad + " rope " + "ok " + pad;
+if (errors != 0) {
+  print errors;
+}
@@ -0,0 +1,93 @@
+// 表: 小表 (不超过 4 个键) 长大成 SwissTable, 键被 GC 删掉后再插回来
+var errors = 0;
+
+// 实例字段从 1 个长到 10 个, 跨过小表的上限
+class Bag {
+  one() { return 1; }
+  two() { return 2; }
+  three() { return 3; }
+  four() { return 4; }
+  five() { return 5; }
+  six() { return 6; }
+}
+var bag = Bag();
+bag.a = 1;
+bag.b = 2;
+bag.c = 3;
+bag.d = 4;
+if (bag.a + bag.b + bag.c + bag.d != 10) {
+  errors = errors + 1;
+}
+bag.e = 5;
+bag.f = 6;
+bag.g = 7;
+bag.h = 8;
+bag.i = 9;
+bag.j = 10;
+if (bag.a + bag.b + bag.c + bag.d + bag.e + bag.f + bag.g + bag.h + bag.i +
+    bag.j != 55) {
+  errors = errors + 1;
+}
+// 覆盖已有的键不能多出新槽位
+bag.a = 100;
+bag.j = 1000;
+if (bag.a + bag.j + bag.e != 1105) {
+  errors = errors + 1;
+}
+// 方法表也超过 4 个
+if (bag.one() + bag.two() + bag.three() + bag.four() + bag.five() +
+    bag.six() != 21) {
+  errors = errors + 1;
+}
+
+// 运行时拼出来的字符串要进 vm.strings, 相等的拼法得到同一个串
+fun piece(n) {
+  if (n == 0) return "a";
+  if (n == 1) return "b";
+  if (n == 2) return "c";
+  if (n == 3) return "d";
+  if (n == 4) return "e";
+  if (n == 5) return "f";
+  if (n == 6) return "g";
+  return "h";
+}
+
+// 拼出 512 个不同的串后全部丢掉, 回收时从 vm.strings 删除, 表跟着缩小
+fun churn() {
+  var count = 0;
+  var i = 0;
+  while (i < 8) {
+    var j = 0;
+    while (j < 8) {
+      var k = 0;
+      while (k < 8) {
+        var key = piece(i) + piece(j) + piece(k);
+        if (key == piece(i) + piece(j) + piece(k)) {
+          count = count + 1;
+        }
+        k = k + 1;
+      }
+      j = j + 1;
+    }
+    i = i + 1;
+  }
+  return count;
+}
+
+// 第二轮把删掉的串重新插回去, 和字面量还要相等
+var round = 0;
+while (round < 3) {
+  if (churn() != 512) {
+    errors = errors + 1;
+  }
+  if (piece(7) + piece(0) + piece(2) != "hac") {
+    errors = errors + 1;
+  }
+  round = round + 1;
+}
+
+if (errors == 0) {
+  print "table ok";
+} else {
+  print errors;
+}
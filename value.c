@@ -25,7 +25,7 @@ void writeVlaueArray(ValueArray *array, Value value) {
 }
 
 void freeVlaueArray(ValueArray *array) {
-  FREE_ARRAY(Value, array->values, 0);
+  FREE_ARRAY(Value, array->values, array->capacity);
   initVlaueArray(array);
   // FREE(array);
 }
@@ -65,7 +65,19 @@ bool valueEqual(Value a, Value b) {
     // ObjString *bstring = AS_STRING(b);
     // return (astring->length == bstring->length) &&
     //        memcmp(astring->chars, bstring->chars, astring->length) == 0;
-    return AS_OBJ(a) == AS_OBJ(b);
+    if (AS_OBJ(a) == AS_OBJ(b)) {
+      return true;
+    }
+    if (IS_BOUND_METHOD(a) && IS_BOUND_METHOD(b)) {
+      // 取方法时可能拿到缓存的, 也可能新分配, 比较结果不能受影响
+      return AS_BOUND_METHOD(a)->method == AS_BOUND_METHOD(b)->method &&
+             valueEqual(AS_BOUND_METHOD(a)->receiver,
+                        AS_BOUND_METHOD(b)->receiver);
+    }
+    if (!isStringValue(a) || !isStringValue(b)) {
+      return false;
+    }
+    return stringEqual(AS_OBJ(a), AS_OBJ(b));
   default:
     return false;
   }
@@ -30,11 +30,6 @@ typedef struct {
   } as;
 } Value;
 
-typedef struct {
-  ObjString *key;
-  Value value;
-} Entry;
-
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
@@ -1,9 +1,11 @@
 #include "vm.h"
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "module.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -15,55 +17,143 @@
 #include <string.h>
 #include <time.h>
 
-VM vm;
+_Thread_local VM vm;
+
+#define ROPE_MIN_LENGTH 64 // 更短的拼接直接复制
 
 // native functions
 static Value clockNative(uint8_t argCount, Value *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// 没有哪个类定义过这个名字的方法时返回 -1
+static int findSelector(ObjString *name) {
+  Value selector;
+  if (!tableGet(&vm.selectors, name, &selector)) {
+    return -1;
+  }
+  return (int)AS_NUMBER(selector);
+}
+
+// 编译时给方法名分配全局 selector
+int methodSelector(ObjString *name) {
+  int selector = findSelector(name);
+  if (selector >= 0) {
+    return selector;
+  }
+  selector = vm.selector_names.count;
+  push(OBJ_VAL(name)); // GC
+  writeVlaueArray(&vm.selector_names, OBJ_VAL(name));
+  tableSet(&vm.selectors, name, NUMBER_VAL(selector));
+  pop();
+  return selector;
+}
+
+static void growMethods(ObjClass *kclass, int count) {
+  int old_count = kclass->method_count;
+  int new_count = (count + 7) & ~7;
+  kclass->methods =
+      GROW_ARRAY(ObjClosure *, kclass->methods, old_count, new_count);
+  for (int i = old_count; i < new_count; i++) {
+    kclass->methods[i] = NULL;
+  }
+  kclass->method_count = new_count;
+}
+
 // binding method
-static void defineMethod(ObjString *name) {
-  Value method = peek(0);
+static void defineMethod(int selector) {
+  ObjClosure *method = AS_CLOSURE(peek(0));
   ObjClass *kclass = AS_CLASS(peek(1));
-  tableSet(&kclass->methods, name, method);
+  if (selector >= kclass->method_count) {
+    growMethods(kclass, selector + 1);
+  }
+  kclass->methods[selector] = method;
   pop();
 }
 
-static bool bindMethod(ObjClass *kclass, ObjString *name) {
-  Value method;
-  if (!tableGet(&kclass->methods, name, &method)) {
+// 循环里反复 `var f = obj.m;` 不用每次都分配
+static ObjBoundMethod *boundMethod(Value receiver, ObjClosure *method) {
+  uintptr_t key = ((uintptr_t)AS_OBJ(receiver) ^ ((uintptr_t)method >> 4)) >> 4;
+  ObjBoundMethod **slot = &vm.bound_cache[key & (BOUND_CACHE_SIZE - 1)];
+  if (*slot != NULL && AS_OBJ((*slot)->receiver) == AS_OBJ(receiver) &&
+      (*slot)->method == method) {
+    return *slot;
+  }
+  *slot = newBoundMethod(receiver, method);
+  return *slot;
+}
+
+static bool bindMethod(ObjClass *kclass, int selector, ObjString *name) {
+  ObjClosure *method = selector >= 0 ? classMethod(kclass, selector) : NULL;
+  if (method == NULL) {
     runtimeError("undefined property `%s`", name->chars);
     return false;
   }
-  ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+  ObjBoundMethod *bound = boundMethod(peek(0), method);
   pop();
   push(OBJ_VAL(bound));
   return true;
 }
 
+// /dev/urandom 不可用时退回到时间和栈地址
+static uint64_t randomSeed() {
+  uint64_t seed = 0;
+  FILE *file = fopen("/dev/urandom", "rb");
+  if (file != NULL) {
+    if (fread(&seed, sizeof(seed), 1, file) != 1) {
+      seed = 0;
+    }
+    fclose(file);
+  }
+  seed ^= (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32);
+  seed ^= (uint64_t)(uintptr_t)&seed;
+  // splitmix64
+  seed += 0x9e3779b97f4a7c15ull;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+  return seed ^ (seed >> 31);
+}
+
 void initVM() {
+  initHeap(&vm.heap);
+  vm.hash_seed = randomSeed();
   resetStack();
-  vm.objects = NULL;
   initTable(&vm.strings);
   initTable(&vm.globals);
-  defineNative("clock", clockNative);
-  // GC
+  initTable(&vm.selectors);
+  initVlaueArray(&vm.selector_names);
+  // GC, 下面第一次分配就可能触发回收, 所有根要先就位
   vm.gray_count = 0;
   vm.gray_capacity = 0;
   vm.gray_stack = NULL;
   vm.bytes_allocated = 0;
   vm.next_gc = 1024 * 1024;
-
+  vm.compact_pending = false;
+  vm.gc_running = false;
+  vm.lazy_compile = false;
+  vm.images = NULL;
+  initTable(&vm.modules);
+  vm.module_sources = NULL;
+  vm.parsers = NULL;
+  memset(vm.bound_cache, 0, sizeof(vm.bound_cache));
   vm.init_string = NULL;
+
+  defineNative("clock", clockNative);
   vm.init_string = copyString("init", 4);
+  methodSelector(vm.init_string); // INIT_SELECTOR
 }
 
 void freeVM() {
   freeTable(&vm.strings);
   freeTable(&vm.globals);
+  freeTable(&vm.selectors);
+  freeTable(&vm.modules);
+  freeVlaueArray(&vm.selector_names);
   vm.init_string = NULL;
   freeObjects();
+  freeCacheImages();
+  freeModuleSources();
+  freeHeap(&vm.heap);
 }
 
 bool isNumber(Value v) {
@@ -106,7 +196,8 @@ Value binaryEval(char ch) {
       return gt;
     }
 
-  } else if (IS_STRING(peek(0)) && IS_STRING(peek(1)) && ch == '+') {
+  } else if (isStringValue(peek(0)) && isStringValue(peek(1)) &&
+             ch == '+') {
     return concatenate();
   } else {
     switch (ch) {
@@ -124,11 +215,16 @@ static InterpretResult run() {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define CONSTANT_AT(index)                                                     \
+  (frame->closure->function->chunk.constants.values[index])
+#define READ_CONSTANT() CONSTANT_AT(READ_BYTE())
 #define READ_SHORT()                                                           \
   (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG() (frame->ip += 3, readLongOperand(frame->ip - 3))
+// 短指令和 _LONG 版本共用实现, 只有常量下标的宽度不同
+#define READ_OPERAND(long_op)                                                  \
+  (instruction == (long_op) ? READ_LONG() : READ_BYTE())
+#define READ_STRING(long_op) AS_STRING(CONSTANT_AT(READ_OPERAND(long_op)))
 
   // #define BINARY_OP(op)                                                          \
 //   do {                                                                         \
@@ -162,6 +258,9 @@ static InterpretResult run() {
       push(constant);
       break;
     }
+    case OP_CONSTANT_LONG:
+      push(CONSTANT_AT(READ_LONG()));
+      break;
 
     case OP_NEGATE:
       if (!isNumber(peek(0))) {
@@ -208,9 +307,11 @@ static InterpretResult run() {
       push(notValue);
       break;
     case OP_EQUAL:
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valueEqual(a, b)));
+      // rope 比较时会展开, 先留在栈上
+      bool equal = valueEqual(peek(1), peek(0));
+      pop();
+      pop();
+      push(BOOL_VAL(equal));
       break;
     case OP_LESS:
       push(binaryEval('<'));
@@ -219,7 +320,8 @@ static InterpretResult run() {
       push(binaryEval('>'));
       break;
     case OP_PRINT:
-      printValue(pop());
+      printValue(peek(0)); // 打印 rope 时要分配, 先留在栈上
+      pop();
       printf("\n");
       break;
     case OP_POP:
@@ -228,12 +330,14 @@ static InterpretResult run() {
       // printf("\n");
       break;
     case OP_DEFINE_GLOBAL:
-      ObjString *var_name = READ_STRING();
+    case OP_DEFINE_GLOBAL_LONG:
+      ObjString *var_name = READ_STRING(OP_DEFINE_GLOBAL_LONG);
       tableSet(&vm.globals, var_name, peek(0));
       pop();
       break;
     case OP_GET_GLOBAL:
-      ObjString *vname = READ_STRING();
+    case OP_GET_GLOBAL_LONG:
+      ObjString *vname = READ_STRING(OP_GET_GLOBAL_LONG);
       Value value;
       if (!tableGet(&vm.globals, vname, &value)) {
         runtimeError("undfined variable `%s`.", vname->chars);
@@ -243,7 +347,8 @@ static InterpretResult run() {
       }
       break;
     case OP_SET_GLOBAL:
-      ObjString *sname = READ_STRING();
+    case OP_SET_GLOBAL_LONG:
+      ObjString *sname = READ_STRING(OP_SET_GLOBAL_LONG);
       if (tableSet(&vm.globals, sname, peek(0))) {
         tableDelete(&vm.globals, sname);
         runtimeError("undefined variable `%s`.", sname->chars);
@@ -272,6 +377,15 @@ static InterpretResult run() {
     case OP_LOOP:
       uint16_t loop_offset = READ_SHORT();
       frame->ip -= loop_offset;
+      if (vm.stackTop + FRAME_STACK_MAX > vm.stack + STACK_MAX) {
+        runtimeError("stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+#ifdef GC_COMPACT
+      if (vm.compact_pending) {
+        compactHeap(); // safe point
+      }
+#endif
       break;
     case OP_CALL:
       uint8_t argCount = READ_BYTE();
@@ -281,8 +395,11 @@ static InterpretResult run() {
       frame = &vm.frames[vm.frameCount - 1];
       break;
     case OP_CLOSURE:
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+    case OP_CLOSURE_LONG:
+      ObjFunction *function =
+          AS_FUNCTION(CONSTANT_AT(READ_OPERAND(OP_CLOSURE_LONG)));
       ObjClosure *closure = newClosure(function);
+      push(OBJ_VAL(closure)); // captureUpvalue 会分配
 
       for (int i = 0; i < closure->upvalue_count; i++) {
         uint8_t is_local = READ_BYTE();
@@ -293,7 +410,6 @@ static InterpretResult run() {
           closure->upvalues[i] = frame->closure->upvalues[idx];
         }
       }
-      push(OBJ_VAL(closure));
       break;
     case OP_SET_UPVALUE:
       uint8_t _slot = READ_BYTE();
@@ -308,26 +424,33 @@ static InterpretResult run() {
       pop();
       break;
     case OP_CLASS:
-      push(OBJ_VAL(newClass(READ_STRING())));
+    case OP_CLASS_LONG:
+      push(OBJ_VAL(newClass(READ_STRING(OP_CLASS_LONG))));
       break;
     case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
       if (!IS_INSTANCE(peek(1))) {
         runtimeError("only instance have fields.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjInstance *ins = AS_INSTANCE(peek(1));
-      tableSet(&ins->fields, READ_STRING(), peek(0));
+      if (tableSet(&ins->fields, READ_STRING(OP_SET_PROPERTY_LONG), peek(0)) &&
+          ins->fields.count > ins->kclass->field_hint &&
+          ins->fields.count <= FIELD_HINT_MAX) {
+        ins->kclass->field_hint = ins->fields.count;
+      }
       Value value_s = pop();
       pop(); // instance
       push(value_s);
       break;
     case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
       if (!IS_INSTANCE(peek(0))) {
         runtimeError("only instance have properties.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjInstance *instance = AS_INSTANCE(peek(0));
-      ObjString *name = READ_STRING(); // property name.
+      ObjString *name = READ_STRING(OP_GET_PROPERTY_LONG); // property name.
 
       Value value_c;
       if (tableGet(&instance->fields, name, &value_c)) {
@@ -335,50 +458,81 @@ static InterpretResult run() {
         push(value_c);
         break;
       }
-      if (!bindMethod(instance->kclass, name)) {
+      if (!bindMethod(instance->kclass, findSelector(name), name)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       break;
     case OP_METHOD:
-      defineMethod(READ_STRING());
+      // 编译器生成的代码不会出错, 这里防的是坏掉的缓存
+      if (!IS_CLOSURE(peek(0)) || !IS_CLASS(peek(1))) {
+        runtimeError("method must be defined in a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      defineMethod(READ_SHORT());
       break;
     case OP_INVOKE:
-      ObjString *method_name = READ_STRING();
+      uint16_t selector = READ_SHORT();
       uint8_t args = READ_BYTE();
-      if (!invoke(method_name, args)) {
+      if (!invoke(selector, args)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       frame = &vm.frames[vm.frameCount - 1];
       break;
     case OP_INHERIT:
       Value super_calss = peek(1);
-      if (!IS_CLASS(super_calss)) {
+      if (!IS_CLASS(super_calss) || !IS_CLASS(peek(0))) {
         runtimeError("superClass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
       }
 
       ObjClass *subclass = AS_CLASS(peek(0));
-      tableAddAll(&AS_CLASS(super_calss)->methods, &subclass->methods);
+      ObjClass *parent = AS_CLASS(super_calss);
+      // copy-down, 子类的方法之后再覆盖
+      if (parent->method_count > subclass->method_count) {
+        growMethods(subclass, parent->method_count);
+      }
+      if (parent->method_count > 0) { // 没有方法时两边都是 NULL
+        memcpy(subclass->methods, parent->methods,
+               sizeof(ObjClosure *) * parent->method_count);
+      }
+      subclass->field_hint = parent->field_hint;
       pop();
       break;
     case OP_GET_SUPER:
-      ObjString *super_method_name = READ_STRING();
+      uint16_t super_selector = READ_SHORT();
+      if (!IS_CLASS(peek(0))) {
+        runtimeError("superClass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
       ObjClass *superclass = AS_CLASS(pop());
-      if (!bindMethod(superclass, super_method_name)) {
+      if (!bindMethod(superclass, super_selector,
+                      SELECTOR_NAME(super_selector))) {
         return INTERPRET_RUNTIME_ERROR;
       }
       break;
     case OP_SUPER_INVOKE:
-      ObjString *super_name = READ_STRING();
+      uint16_t super_name = READ_SHORT();
       uint8_t arguments = READ_BYTE();
+      if (!IS_CLASS(peek(0))) {
+        runtimeError("superClass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
       ObjClass *super_class = AS_CLASS(pop());
 
-      Value super_method;
-      if (!tableGet(&super_class->methods, super_name, &super_method)) {
-        runtimeError("undefined superclass method `%s`.", super_name->chars);
+      ObjClosure *super_method = classMethod(super_class, super_name);
+      if (super_method == NULL) {
+        runtimeError("undefined superclass method `%s`.",
+                     SELECTOR_NAME(super_name)->chars);
         return INTERPRET_RUNTIME_ERROR;
       } else {
-        call_(AS_CLOSURE(super_method), arguments);
+        call_(super_method, arguments);
+      }
+      frame = &vm.frames[vm.frameCount - 1];
+      break;
+    case OP_IMPORT:
+    case OP_IMPORT_LONG:
+      if (!importModule(READ_STRING(OP_IMPORT_LONG))) {
+        return INTERPRET_RUNTIME_ERROR;
       }
       frame = &vm.frames[vm.frameCount - 1];
       break;
@@ -393,15 +547,23 @@ static InterpretResult run() {
       vm.stackTop = frame->slots;
       push(res);
       frame = &vm.frames[vm.frameCount - 1];
+#ifdef GC_COMPACT
+      if (vm.compact_pending) {
+        compactHeap(); // safe point
+      }
+#endif
       break;
     }
     } // switch end
   }
 
 #undef READ_BYTE
+#undef CONSTANT_AT
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_OPERAND
   // #undef BINARY_OP
 }
 
@@ -411,7 +573,11 @@ InterpretResult interpret(const char *source) {
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
+  return interpretFunction(function);
+}
 
+// 执行已经编译好的顶层函数, 比如从字节码缓存载入的
+InterpretResult interpretFunction(ObjFunction *function) {
   push(OBJ_VAL(function));
   // CallFrame *frame = &vm.frames[vm.frameCount];
   // frame->function = function;
@@ -483,27 +649,93 @@ static bool isFalsey(Value value) {
 
 // 字符串连接
 static Value concatenate() {
-  ObjString *bstring = AS_STRING(peek(0));
-  ObjString *astring = AS_STRING(peek(1));
-  int length = astring->length + bstring->length;
-  char *headChars = ALLOCATE(char, length + 1);
-  memcpy(headChars, astring->chars, astring->length);
-  memcpy(headChars + astring->length, bstring->chars, bstring->length);
-  headChars[length] = '\0';
-  ObjString *result = takeString(headChars, length);
+  Obj *b = AS_OBJ(peek(0));
+  Obj *a = AS_OBJ(peek(1));
+  int length = stringLength(a) + stringLength(b);
+  if (length >= ROPE_MIN_LENGTH) {
+    // 不复制也不哈希, 等需要字符内容时再展开
+    ObjRope *rope = newRope(a, b, length);
+    pop();
+    pop();
+    return OBJ_VAL(rope);
+  }
+
+  // 两边都比 ROPE_MIN_LENGTH 短, 不会是 rope
+  ObjString *bstring = (ObjString *)b;
+  ObjString *astring = (ObjString *)a;
+  ObjString *result = newString(length);
+  memcpy(result->chars, astring->chars, astring->length);
+  memcpy(result->chars + astring->length, bstring->chars, bstring->length);
   pop();
   pop();
   return OBJ_VAL(result);
 }
 
+// 每个规范路径只执行一次, 再次导入只压一个 nil 代替顶层函数的返回值
+// 相对路径从正在执行 import 的文件所在目录算起, REPL 里从当前目录
+static char *resolveImport(ObjString *path) {
+  ObjString *importer =
+      vm.frames[vm.frameCount - 1].closure->function->module;
+  if (importer == NULL || path->chars[0] == '/') {
+    return realpath(path->chars, NULL);
+  }
+  size_t dir = (size_t)(strrchr(importer->chars, '/') - importer->chars) + 1;
+  char *joined = (char *)malloc(dir + path->length + 1);
+  if (joined == NULL) {
+    exit(1);
+  }
+  memcpy(joined, importer->chars, dir);
+  memcpy(joined + dir, path->chars, path->length + 1);
+  char *resolved = realpath(joined, NULL);
+  free(joined);
+  return resolved;
+}
+
+static bool importModule(ObjString *path) {
+  char *resolved = resolveImport(path);
+  if (resolved == NULL) {
+    runtimeError("can't find module `%s`.", path->chars);
+    return false;
+  }
+  ObjString *canonical = copyString(resolved, (int)strlen(resolved));
+  free(resolved);
+  Value module;
+  if (tableGet(&vm.modules, canonical, &module)) {
+    push(NIL_VAL);
+    return true;
+  }
+
+  push(OBJ_VAL(canonical)); // GC
+  ObjFunction *function = loadModule(canonical->chars);
+  if (function == NULL) {
+    runtimeError("can't load module `%s`.", path->chars);
+    return false;
+  }
+  push(OBJ_VAL(function));
+  setFunctionModule(function, canonical);
+  ObjClosure *closure = newClosure(function);
+  pop();
+  push(OBJ_VAL(closure));
+  // 先登记再执行, 循环导入时不会再进来
+  tableSet(&vm.modules, canonical, OBJ_VAL(closure));
+  vm.stackTop[-2] = OBJ_VAL(closure); // 换掉 canonical
+  pop();
+  return call_(closure, 0);
+}
+
 static bool call_(ObjClosure *closure, uint8_t argCount) {
+  if (closure->function->lazy != NULL && !compileLazy(closure->function)) {
+    runtimeError("can't compile function body.");
+    return false;
+  }
   if (argCount != closure->function->arity) {
     runtimeError("expect %d arguments but got %d.", closure->function->arity,
                  argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAME_MAX) {
+  if (vm.frameCount == FRAME_MAX ||
+      vm.stackTop + FRAME_STACK_MAX > vm.stack + STACK_MAX) {
     runtimeError("stack overflow.");
     return false;
   }
@@ -531,9 +763,9 @@ static bool callValue(Value callee, uint8_t argCount) {
     case OBJ_CLASS:
       ObjClass *kclass = AS_CLASS(callee);
       vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(kclass));
-      Value initializer;
-      if (tableGet(&kclass->methods, vm.init_string, &initializer)) {
-        return call_(AS_CLOSURE(initializer), argCount);
+      ObjClosure *initializer = classMethod(kclass, INIT_SELECTOR);
+      if (initializer != NULL) {
+        return call_(initializer, argCount);
       } else if (argCount != 0) {
         runtimeError("expected 0 argments but got %d.", argCount);
         return false;
@@ -552,7 +784,7 @@ static bool callValue(Value callee, uint8_t argCount) {
   return false;
 }
 
-static bool invoke(ObjString *method_name, uint8_t args) {
+static bool invoke(int selector, uint8_t args) {
   Value receiver = peek(args);
   if (!IS_INSTANCE(receiver)) {
     runtimeError("only instances have methods.");
@@ -562,17 +794,17 @@ static bool invoke(ObjString *method_name, uint8_t args) {
 
   //! this.bar = fun
   Value fn;
-  if (tableGet(&ins->fields, method_name, &fn)) {
+  if (tableGet(&ins->fields, SELECTOR_NAME(selector), &fn)) {
     vm.stackTop[-args - 1] = fn;
     return callValue(fn, args);
   }
 
-  Value method;
-  if (!tableGet(&ins->kclass->methods, method_name, &method)) {
-    runtimeError("undefined property `%s`.", method_name->chars);
+  ObjClosure *method = classMethod(ins->kclass, selector);
+  if (method == NULL) {
+    runtimeError("undefined property `%s`.", SELECTOR_NAME(selector)->chars);
     return false;
   }
-  return call_(AS_CLOSURE(method), args);
+  return call_(method, args);
 }
 
 static void defineNative(const char *name, NativeFn function) {
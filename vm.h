@@ -1,13 +1,18 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "cache.h"
 #include "chunk.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include <stdint.h>
+#define BOUND_CACHE_SIZE 256
 #define STACK_MAX 2048
 #define FRAME_MAX 64
+// 调用和往回跳时栈上至少要留这么多, 载入的缓存里每帧不能用得更多
+#define FRAME_STACK_MAX 256
 
 // callFrame 正在执行的函数调用
 typedef struct {
@@ -22,16 +27,29 @@ typedef struct {
   int frameCount;
   Value stack[STACK_MAX]; // VM stack
   Value *stackTop;
-  Obj *objects;  // GC
+  Heap heap;     // GC
   Table strings; // string interning
+  uint64_t hash_seed; // 每个 VM 随机, 防止构造碰撞
   Table globals;
+  // method selector: 方法名 -> 所有类共用的 vtable 下标
+  Table selectors;
+  ValueArray selector_names;
+  // 最近取出的 bound method, 按 (receiver, method) 直接映射; GC 时弱引用
+  ObjBoundMethod *bound_cache[BOUND_CACHE_SIZE];
   ObjUpvalue *open_upvalues;
+  CacheImage *images; // 映射进来的字节码缓存
+  Table modules; // 规范路径 -> 模块顶层 closure, 每个文件只执行一次
+  struct ModuleSource *module_sources;
+  struct Parser *parsers; // 正在进行的编译, 编译中的函数是 GC 根
   // GC
   int gray_count;
   int gray_capacity;
   Obj **gray_stack;
   size_t bytes_allocated; // 托管内存
   size_t next_gc;         // 触发下一次GC
+  bool compact_pending;   // 下一个 safe point 整理堆
+  bool gc_running;        // 回收过程中的分配不能再触发回收
+  bool lazy_compile;      // 函数体第一次调用时才编译
   // class
   ObjString *init_string;
 } VM;
@@ -42,11 +60,17 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+extern _Thread_local VM vm;
+
+#define INIT_SELECTOR 0 // initVM 最先登记 "init"
+#define SELECTOR_NAME(selector) AS_STRING(vm.selector_names.values[selector])
+
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+InterpretResult interpretFunction(ObjFunction *function);
+int methodSelector(ObjString *name);
 static void resetStack();
 void push(Value value);
 Value pop();
@@ -55,8 +79,10 @@ static void runtimeError(const char *format, ...);
 static bool isFalsey(Value value);
 static Value concatenate();
 static bool callValue(Value callee, uint8_t argCount);
-static bool invoke(ObjString *method_name, uint8_t args);
+static bool invoke(int selector, uint8_t args);
 static bool call_(ObjClosure *closure, uint8_t argCount);
+static char *resolveImport(ObjString *path);
+static bool importModule(ObjString *path);
 static void defineNative(const char *name, NativeFn function);
 static ObjUpvalue *captureUpvalue(Value *local);
 static void closeUpvalues(Value *last);